@@ -0,0 +1,248 @@
+#include <proto/exec.h>
+#include <proto/dos.h>
+
+#include <exec/errors.h>
+#include <devices/serial.h>
+#include <dos/rdargs.h>
+
+#include "um245r.h"
+
+// Push data through the loopback unit of um245r.device and time it.
+// With no hardware in the way this is the cost of the driver itself.
+
+#define TEMPLATE "UNIT/N,READSIZE/N,WRITESIZE/N,TOTAL/N,TERM/N,REQUESTS/N,BUFSIZE/N"
+
+#define OPT_UNIT 0
+#define OPT_READSIZE 1
+#define OPT_WRITESIZE 2
+#define OPT_TOTAL 3
+#define OPT_TERM 4
+#define OPT_REQUESTS 5
+#define OPT_BUFSIZE 6
+#define OPT_COUNT 7
+
+#define MAX_REQUESTS 32
+
+static unsigned long total, received, outstanding, readsize;
+
+// What byte should be at a given position of the stream.
+static unsigned char pattern(unsigned long pos, unsigned long writesize, long term) {
+    if (term >= 0 && (pos % writesize) == writesize - 1) return term;
+    return 'A' + (pos % 26);
+}
+
+// Send a read off again, but only for as much as is still to come so
+// that the last few reads don't sit waiting for data that never comes.
+static int issue(struct IOExtSer *req) {
+    unsigned long n = total - received - outstanding;
+    if (n > readsize) n = readsize;
+    if (n == 0) return 0;
+
+    req->IOSer.io_Command = CMD_READ;
+    req->IOSer.io_Length = n;
+    outstanding += n;
+    SendIO((struct IORequest *)req);
+    return 1;
+}
+
+// DoIO() on the control request. The driver replies to requests it
+// finishes quickly as well, which leaves them sitting on the reply port,
+// so take it back off there before it gets used again.
+static LONG ctlIO(struct IOExtSer *ctl) {
+    LONG r = DoIO((struct IORequest *)ctl);
+    while (GetMsg(ctl->IOSer.io_Message.mn_ReplyPort) != NULL);
+    return r;
+}
+
+static unsigned long ticksSince(struct DateStamp *then) {
+    struct DateStamp now;
+    DateStamp(&now);
+    return ((now.ds_Days - then->ds_Days) * 24 * 60 + (now.ds_Minute - then->ds_Minute)) * 60 * TICKS_PER_SECOND
+        + (now.ds_Tick - then->ds_Tick);
+}
+
+int main() {
+    LONG opts[OPT_COUNT] = { 0 };
+    struct RDArgs *args;
+    struct MsgPort *port = NULL;
+    struct MsgPort *ctlport = NULL;
+    struct IOExtSer *ctl = NULL;
+    struct IOExtSer *rd[MAX_REQUESTS] = { NULL };
+    unsigned char *rbuf[MAX_REQUESTS] = { NULL };
+    char busy[MAX_REQUESTS] = { 0 };
+    unsigned char *wbuf = NULL;
+    int rc = RETURN_FAIL;
+    int open = 0;
+    int i;
+
+    args = ReadArgs(TEMPLATE, opts, NULL);
+    if (args == NULL) {
+        PrintFault(IoErr(), "ftbench");
+        return RETURN_FAIL;
+    }
+
+    unsigned long unit = opts[OPT_UNIT] ? *(LONG *)opts[OPT_UNIT] : FT_UNIT_LOOPBACK;
+    readsize = opts[OPT_READSIZE] ? *(LONG *)opts[OPT_READSIZE] : 256;
+    unsigned long writesize = opts[OPT_WRITESIZE] ? *(LONG *)opts[OPT_WRITESIZE] : 256;
+    total = opts[OPT_TOTAL] ? *(LONG *)opts[OPT_TOTAL] : 1024 * 1024;
+    long term = opts[OPT_TERM] ? (*(LONG *)opts[OPT_TERM] & 0xFF) : -1;
+    int requests = opts[OPT_REQUESTS] ? *(LONG *)opts[OPT_REQUESTS] : 4;
+    unsigned long bufsize = opts[OPT_BUFSIZE] ? *(LONG *)opts[OPT_BUFSIZE] : 4096;
+    FreeArgs(args);
+
+    // Never have more in flight than the loopback queue can hold,
+    // otherwise we'd be measuring dropped bytes.
+    if (requests < 1 || requests > MAX_REQUESTS || readsize == 0 || writesize == 0 || writesize >= FT_LOOP_SIZE) {
+        Printf("ftbench: REQUESTS must be 1-%ld and WRITESIZE below %ld\n", (LONG)MAX_REQUESTS, (LONG)FT_LOOP_SIZE);
+        return RETURN_ERROR;
+    }
+
+    // The reads come back on a port of their own, so that nothing but
+    // ctl ever turns up on the one ctlIO() clears out.
+    port = CreateMsgPort();
+    ctlport = CreateMsgPort();
+    if (port == NULL || ctlport == NULL) goto done;
+
+    ctl = (struct IOExtSer *)CreateIORequest(ctlport, sizeof(struct IOExtSer));
+    wbuf = AllocMem(writesize, 0);
+    if (ctl == NULL || wbuf == NULL) goto done;
+
+    if (OpenDevice("um245r.device", unit, (struct IORequest *)ctl, 0) != 0) {
+        Printf("ftbench: can't open um245r.device unit %ld\n", unit);
+        goto done;
+    }
+    open = 1;
+
+    ctl->IOSer.io_Command = SDCMD_SETPARAMS;
+    ctl->io_RBufLen = bufsize;
+    ctl->io_SerFlags = 0x84;
+    ctl->io_TermArray.TermArray0 = 0;
+    ctl->io_TermArray.TermArray1 = 0;
+    if (term >= 0) {
+        ctl->io_SerFlags |= SERF_EOFMODE;
+        ctl->io_TermArray.TermArray0 = ctl->io_TermArray.TermArray1 = term * 0x01010101;
+    }
+    if (ctlIO(ctl) != 0) {
+        Printf("ftbench: SETPARAMS failed (%ld)\n", (LONG)ctl->IOSer.io_Error);
+        goto done;
+    }
+
+    for (i = 0; i < requests; i++) {
+        rd[i] = (struct IOExtSer *)CreateIORequest(port, sizeof(struct IOExtSer));
+        rbuf[i] = AllocMem(readsize, 0);
+        if (rd[i] == NULL || rbuf[i] == NULL) goto done;
+        rd[i]->IOSer.io_Device = ctl->IOSer.io_Device;
+        rd[i]->IOSer.io_Unit = ctl->IOSer.io_Unit;
+        rd[i]->IOSer.io_Data = rbuf[i];
+    }
+
+    unsigned long written = 0, checked = 0;
+    unsigned long writes = 0, reads = 0, errors = 0;
+    struct DateStamp start;
+
+    DateStamp(&start);
+
+    for (i = 0; i < requests; i++) {
+        busy[i] = issue(rd[i]);
+    }
+
+    while (received < total) {
+        // Keep the queue topped up as far as it will safely go.
+        while (written < total && written - received + writesize < FT_LOOP_SIZE) {
+            unsigned long n = writesize;
+            unsigned long j;
+            if (n > total - written) n = total - written;
+            for (j = 0; j < n; j++) {
+                wbuf[j] = pattern(written + j, writesize, term);
+            }
+            ctl->IOSer.io_Command = CMD_WRITE;
+            ctl->IOSer.io_Data = wbuf;
+            ctl->IOSer.io_Length = n;
+            ctlIO(ctl);
+            written += n;
+            writes++;
+        }
+
+        WaitPort(port);
+
+        struct IOExtSer *req;
+        while ((req = (struct IOExtSer *)GetMsg(port)) != NULL) {
+            unsigned char *data = req->IOSer.io_Data;
+            unsigned long j;
+
+            for (i = 0; i < requests && rd[i] != req; i++);
+            if (i == requests) continue;
+            busy[i] = 0;
+            outstanding -= req->IOSer.io_Length;
+
+            if (req->IOSer.io_Error != 0) {
+                Printf("ftbench: read failed (%ld) after %lu bytes\n", (LONG)req->IOSer.io_Error, received);
+                goto abort;
+            }
+
+            for (j = 0; j < req->IOSer.io_Actual; j++) {
+                if (data[j] != pattern(checked++, writesize, term)) errors++;
+            }
+            received += req->IOSer.io_Actual;
+            reads++;
+
+            busy[i] = issue(req);
+        }
+    }
+
+    unsigned long ticks = ticksSince(&start);
+    if (ticks == 0) ticks = 1;
+
+    Printf("%lu bytes in %lu.%02lu s: %lu bytes/s\n", received,
+        ticks / TICKS_PER_SECOND, (ticks % TICKS_PER_SECOND) * 100 / TICKS_PER_SECOND,
+        received * TICKS_PER_SECOND / ticks);
+    Printf("%lu reads, %lu writes: %lu requests/s\n", reads, writes,
+        (reads + writes) * TICKS_PER_SECOND / ticks);
+
+    // The loopback unit flags it if its queue ever overflowed.
+    int overrun = 0;
+    ctl->IOSer.io_Command = SDCMD_QUERY;
+    if (ctlIO(ctl) == 0 && (ctl->io_Status & IO_STATF_OVERRUN)) {
+        Printf("loopback queue overflowed, bytes were lost\n");
+        overrun = 1;
+    }
+
+    // What the driver thinks of its own reply times.
+    struct FTTuning tn;
+    ctl->IOSer.io_Command = FTCMD_GETTUNING;
+    ctl->IOSer.io_Data = &tn;
+    if (ctlIO(ctl) == 0 && tn.tn_Replies != 0) {
+        Printf("%lu replies, worst %lu us, %lu over the %lu us target\n",
+            tn.tn_Replies, tn.tn_Worst, tn.tn_Missed, tn.tn_Latency);
+    }
+
+    if (errors) {
+        Printf("%lu bytes came back wrong\n", errors);
+        rc = RETURN_WARN;
+    } else if (overrun) {
+        rc = RETURN_WARN;
+    } else {
+        rc = RETURN_OK;
+    }
+
+abort:
+    for (i = 0; i < requests; i++) {
+        if (busy[i]) {
+            AbortIO((struct IORequest *)rd[i]);
+            WaitIO((struct IORequest *)rd[i]);
+        }
+    }
+
+done:
+    for (i = 0; i < requests; i++) {
+        if (rbuf[i] != NULL) FreeMem(rbuf[i], readsize);
+        if (rd[i] != NULL) DeleteIORequest((struct IORequest *)rd[i]);
+    }
+    if (open) CloseDevice((struct IORequest *)ctl);
+    if (wbuf != NULL) FreeMem(wbuf, writesize);
+    if (ctl != NULL) DeleteIORequest((struct IORequest *)ctl);
+    if (ctlport != NULL) DeleteMsgPort(ctlport);
+    if (port != NULL) DeleteMsgPort(port);
+    if (rc == RETURN_FAIL) Printf("ftbench: failed\n");
+    return rc;
+}
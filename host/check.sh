@@ -0,0 +1,89 @@
+#!/bin/sh
+# End to end test of ft245r over a pty pair. One instance opens the
+# pty and stands in for the Amiga, the other talks to it through the
+# slave end like it would to the real /dev/ttyUSB* device.
+
+FT=${FT:-./ft245r}
+dir=$(mktemp -d)
+pid=
+fail=0
+
+trap '[ -n "$pid" ] && kill $pid 2>/dev/null; rm -rf "$dir"' EXIT
+
+# Start "ft245r <command> pty ..." in the background and wait for it
+# to say where the slave end is. relay opens two, so it says so twice.
+start() {
+    want=1
+    [ "$1" = relay ] && want=2
+    : > "$dir/slave"
+    "$FT" "$@" > "$dir/slave" 2> "$dir/err" &
+    pid=$!
+    while [ $(wc -l < "$dir/slave") -lt $want ]; do
+        if ! kill -0 $pid 2>/dev/null; then
+            cat "$dir/err" >&2
+            return 1
+        fi
+        sleep 0.1
+    done
+    slave=$(sed -n 1p "$dir/slave")
+    slave2=$(sed -n 2p "$dir/slave")
+}
+
+stop() {
+    kill $pid 2>/dev/null
+    wait $pid 2>/dev/null
+    pid=
+}
+
+result() {
+    if [ "$2" -eq 0 ]; then
+        echo "PASS: $1"
+    else
+        echo "FAIL: $1"
+        fail=1
+    fi
+}
+
+head -c 300000 /dev/urandom > "$dir/in"
+: > "$dir/empty"
+
+# Raw stream: send into recv, which stops once the line goes idle.
+start recv pty "$dir/out" -i 500 && "$FT" send "$slave" "$dir/in" 2> /dev/null
+wait $pid
+cmp -s "$dir/in" "$dir/out"
+result "send / recv" $?
+
+# Block transfers, with data and with nothing at all.
+for f in in empty; do
+    start brecv pty "$dir/out" && "$FT" bsend "$slave" "$dir/$f" 2> /dev/null
+    wait $pid
+    cmp -s "$dir/$f" "$dir/out"
+    result "bsend / brecv ($f)" $?
+done
+
+# Block transfer over a bad line. Bytes going either way are damaged
+# or lost now and then, so NAKs, resends of single blocks, lost ACKs
+# and timeouts all get their turn.
+head -c 20000 /dev/urandom > "$dir/small"
+if start relay pty pty -c 2000 -d 4000; then
+    relay=$pid
+    "$FT" brecv "$slave" "$dir/out" 2> /dev/null &
+    pid=$!
+    "$FT" bsend "$slave2" "$dir/small" 2> /dev/null
+    wait $pid
+    pid=$relay
+    stop
+    cmp -s "$dir/small" "$dir/out"
+    result "bsend / brecv over a bad line" $?
+else
+    result "bsend / brecv over a bad line" 1
+fi
+
+# Throughput and latency through an echoing peer. bench itself checks
+# every byte that comes back.
+start echo pty && "$FT" bench "$slave" -t 1 -n 20 > /dev/null
+r=$?
+stop
+result "bench / echo" $r
+
+exit $fail
@@ -0,0 +1,406 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "ftlink.h"
+
+// Defaults for the bench subcommand.
+#define BENCH_BLOCK 4096
+#define BENCH_WINDOW 16384
+#define BENCH_SECONDS 5
+#define BENCH_PINGS 100
+
+// How long recv waits for more data before deciding the transfer is over.
+#define RECV_IDLE 2000
+
+// Block transfers: how long to wait for the other end before resending,
+// and the most brecv will accept by default.
+#define BLK_TIMEOUT 500
+#define BLK_MAX (16 * 1024 * 1024)
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: ft245r <command> <device> [options]\n"
+        "\n"
+        "  recv <device> <file> [-i idle_ms] [-m max_bytes]\n"
+        "  send <device> <file>\n"
+        "  brecv <device> <file> [-m max_bytes]\n"
+        "  bsend <device> <file>\n"
+        "  echo <device>\n"
+        "  bench <device> [-s block] [-w window] [-t seconds] [-n pings]\n"
+        "  relay <device> <device2> [-c corrupt] [-d drop]\n"
+        "\n"
+        "Use \"" FTL_PTY "\" as the device to create a pty pair; the slave\n"
+        "path is printed so another instance can play the other end.\n"
+    );
+    exit(10);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void link_open(struct ftlink *l, const char *path) {
+    if (ftl_open(l, path) != 0) {
+        perror(path);
+        exit(20);
+    }
+    if (strcmp(path, FTL_PTY) == 0) {
+        printf("%s\n", l->ft_Name);
+        fflush(stdout);
+    }
+}
+
+static int cmd_recv(struct ftlink *l, int argc, char **argv) {
+    int idle = RECV_IDLE;
+    size_t max = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "i:m:")) != -1) {
+        switch (c) {
+            case 'i': idle = atoi(optarg); break;
+            case 'm': max = strtoul(optarg, NULL, 0); break;
+            default: usage();
+        }
+    }
+    if (optind >= argc) usage();
+
+    int out = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror(argv[optind]);
+        return 20;
+    }
+
+    double start = now();
+    ssize_t n = ftl_splice(l, out, max, idle);
+    double secs = now() - start;
+    close(out);
+
+    if (n < 0) {
+        perror("recv");
+        return 20;
+    }
+    fprintf(stderr, "%zd bytes in %.3fs\n", n, secs);
+    return 0;
+}
+
+static int cmd_send(struct ftlink *l, int argc, char **argv) {
+    static char buf[65536];
+    size_t total = 0;
+
+    if (optind >= argc) usage();
+
+    int in = open(argv[optind], O_RDONLY);
+    if (in < 0) {
+        perror(argv[optind]);
+        return 20;
+    }
+
+    double start = now();
+    for (;;) {
+        ssize_t n = read(in, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror(argv[optind]);
+            close(in);
+            return 20;
+        }
+        if (n == 0) break;
+        if (ftl_write(l, buf, n, -1) != n) {
+            perror("send");
+            close(in);
+            return 20;
+        }
+        total += n;
+    }
+    close(in);
+
+    fprintf(stderr, "%zu bytes in %.3fs\n", total, now() - start);
+    return 0;
+}
+
+static int cmd_brecv(struct ftlink *l, int argc, char **argv) {
+    size_t max = BLK_MAX;
+    int c;
+
+    while ((c = getopt(argc, argv, "m:")) != -1) {
+        switch (c) {
+            case 'm': max = strtoul(optarg, NULL, 0); break;
+            default: usage();
+        }
+    }
+    if (optind >= argc) usage();
+
+    unsigned char *buf = malloc(max);
+    if (!buf) {
+        perror("brecv");
+        return 20;
+    }
+
+    double start = now();
+    ssize_t n = ftl_blkrecv(l, buf, max, BLK_TIMEOUT);
+    double secs = now() - start;
+    if (n < 0) {
+        perror("brecv");
+        free(buf);
+        return 20;
+    }
+
+    FILE *out = fopen(argv[optind], "wb");
+    if (!out || fwrite(buf, 1, n, out) != (size_t)n || fclose(out) != 0) {
+        perror(argv[optind]);
+        free(buf);
+        return 20;
+    }
+    free(buf);
+
+    fprintf(stderr, "%zd bytes in %.3fs\n", n, secs);
+    return 0;
+}
+
+static int cmd_bsend(struct ftlink *l, int argc, char **argv) {
+    if (optind >= argc) usage();
+
+    FILE *in = fopen(argv[optind], "rb");
+    if (!in) {
+        perror(argv[optind]);
+        return 20;
+    }
+    fseek(in, 0, SEEK_END);
+    long len = ftell(in);
+    rewind(in);
+
+    unsigned char *buf = malloc(len + 1);
+    if (!buf || fread(buf, 1, len, in) != (size_t)len) {
+        perror(argv[optind]);
+        fclose(in);
+        free(buf);
+        return 20;
+    }
+    fclose(in);
+
+    double start = now();
+    ssize_t n = ftl_blksend(l, buf, len, BLK_TIMEOUT);
+    free(buf);
+    if (n < 0) {
+        perror("bsend");
+        return 20;
+    }
+
+    fprintf(stderr, "%zd bytes in %.3fs\n", n, now() - start);
+    return 0;
+}
+
+// Stand in for the far end: everything that arrives goes straight back.
+static int cmd_echo(struct ftlink *l) {
+    static char buf[65536];
+
+    for (;;) {
+        ssize_t n = ftl_read(l, buf, sizeof(buf), -1);
+        if (n < 0) {
+            perror("echo");
+            return 20;
+        }
+        if (n > 0 && ftl_write(l, buf, n, -1) != n) {
+            perror("echo");
+            return 20;
+        }
+    }
+}
+
+static int cmd_bench(struct ftlink *l, int argc, char **argv) {
+    size_t block = BENCH_BLOCK;
+    size_t window = BENCH_WINDOW;
+    int seconds = BENCH_SECONDS;
+    int pings = BENCH_PINGS;
+    int c;
+
+    while ((c = getopt(argc, argv, "s:w:t:n:")) != -1) {
+        switch (c) {
+            case 's': block = strtoul(optarg, NULL, 0); break;
+            case 'w': window = strtoul(optarg, NULL, 0); break;
+            case 't': seconds = atoi(optarg); break;
+            case 'n': pings = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    if (block == 0 || window < block) usage();
+
+    unsigned char *tx = malloc(block);
+    unsigned char *rx = malloc(window);
+    if (!tx || !rx) {
+        perror("bench");
+        return 20;
+    }
+
+    // Sustained throughput. Keep up to a window's worth of data in
+    // flight through the echoing peer and check every byte that
+    // comes back against the counter pattern that went out.
+    unsigned long long sent = 0, recvd = 0;
+    unsigned long errors = 0;
+    double start = now();
+    double end = start + seconds;
+
+    while (now() < end || recvd < sent) {
+        unsigned int want = EPOLLIN;
+        if (now() < end && sent - recvd + block <= window) {
+            want |= EPOLLOUT;
+        }
+
+        int r = ftl_wait(l, want, 1000);
+        if (r < 0) {
+            perror("bench");
+            return 20;
+        }
+        if (r == 0) {
+            fprintf(stderr, "bench: peer stopped answering\n");
+            return 20;
+        }
+
+        if (r & EPOLLOUT) {
+            for (size_t i = 0; i < block; i++) {
+                tx[i] = (unsigned char)(sent + i);
+            }
+            ssize_t n = ftl_write(l, tx, block, 0);
+            if (n < 0) {
+                perror("bench");
+                return 20;
+            }
+            sent += n;
+        }
+
+        if (r & EPOLLIN) {
+            ssize_t n = ftl_read(l, rx, window, 0);
+            if (n < 0) {
+                perror("bench");
+                return 20;
+            }
+            for (ssize_t i = 0; i < n; i++) {
+                if (rx[i] != (unsigned char)(recvd + i)) errors++;
+            }
+            recvd += n;
+        }
+    }
+
+    double secs = now() - start;
+    printf("throughput: %llu bytes in %.3fs = %.1f KB/s each way, %lu bad bytes\n",
+        recvd, secs, recvd / secs / 1024.0, errors);
+
+    // Round trip latency of a single byte.
+    double min = 1e9, max = 0, sum = 0;
+    for (int i = 0; i < pings; i++) {
+        unsigned char b = (unsigned char)i;
+        double t = now();
+        if (ftl_write(l, &b, 1, 1000) != 1 || ftl_read(l, rx, 1, 1000) != 1) {
+            fprintf(stderr, "bench: ping %d lost\n", i);
+            return 20;
+        }
+        t = now() - t;
+        if (rx[0] != b) errors++;
+        if (t < min) min = t;
+        if (t > max) max = t;
+        sum += t;
+    }
+    if (pings > 0) {
+        printf("latency: %d pings, min %.1fus avg %.1fus max %.1fus\n",
+            pings, min * 1e6, sum / pings * 1e6, max * 1e6);
+    }
+
+    free(tx);
+    free(rx);
+    return errors ? 5 : 0;
+}
+
+// Pass everything between two links, damaging one byte in every so many
+// on average and losing one in every so many. Stands in for a bad line
+// when testing the block transfers.
+static void relay_pass(struct ftlink *from, struct ftlink *to, int corrupt, int drop) {
+    static unsigned char buf[4096];
+    ssize_t n = ftl_read(from, buf, sizeof(buf), 0);
+    ssize_t out = 0;
+
+    for (ssize_t i = 0; i < n; i++) {
+        if (drop && rand() % drop == 0) continue;
+        buf[out] = buf[i];
+        if (corrupt && rand() % corrupt == 0) buf[out] ^= 0x5a;
+        out++;
+    }
+    if (out > 0) ftl_write(to, buf, out, -1);
+}
+
+static int cmd_relay(struct ftlink *l, int argc, char **argv) {
+    struct ftlink m;
+    int corrupt = 0, drop = 0;
+    int c;
+
+    if (optind >= argc) usage();
+    const char *path = argv[optind++];
+
+    while ((c = getopt(argc, argv, "c:d:")) != -1) {
+        switch (c) {
+            case 'c': corrupt = atoi(optarg); break;
+            case 'd': drop = atoi(optarg); break;
+            default: usage();
+        }
+    }
+
+    link_open(&m, path);
+    srand(getpid());
+
+    for (;;) {
+        struct pollfd fds[2] = {
+            { .fd = l->ft_Fd, .events = POLLIN },
+            { .fd = m.ft_Fd, .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("relay");
+            ftl_close(&m);
+            return 20;
+        }
+        if (fds[0].revents & POLLIN) relay_pass(l, &m, corrupt, drop);
+        if (fds[1].revents & POLLIN) relay_pass(&m, l, corrupt, drop);
+    }
+}
+
+int main(int argc, char **argv) {
+    struct ftlink l;
+    int r;
+
+    if (argc < 3) usage();
+
+    const char *cmd = argv[1];
+    link_open(&l, argv[2]);
+    optind = 3;
+
+    if (strcmp(cmd, "recv") == 0) {
+        r = cmd_recv(&l, argc, argv);
+    } else if (strcmp(cmd, "send") == 0) {
+        r = cmd_send(&l, argc, argv);
+    } else if (strcmp(cmd, "brecv") == 0) {
+        r = cmd_brecv(&l, argc, argv);
+    } else if (strcmp(cmd, "bsend") == 0) {
+        r = cmd_bsend(&l, argc, argv);
+    } else if (strcmp(cmd, "echo") == 0) {
+        r = cmd_echo(&l);
+    } else if (strcmp(cmd, "bench") == 0) {
+        r = cmd_bench(&l, argc, argv);
+    } else if (strcmp(cmd, "relay") == 0) {
+        r = cmd_relay(&l, argc, argv);
+    } else {
+        ftl_close(&l);
+        usage();
+        return 10;
+    }
+
+    ftl_close(&l);
+    return r;
+}
@@ -0,0 +1,221 @@
+#include <errno.h>
+#include <string.h>
+
+#include "ftlink.h"
+
+// How many times a transfer will time out in a row before giving up.
+#define FTL_BLK_RETRIES 10
+
+// How many timeouts of silence a receiver waits for after the end of
+// transfer block. Several of them, so that a sender resending on the
+// same interval always gets its repeat answered.
+#define FTL_BLK_QUIET 4
+
+static const unsigned short crcTable[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+unsigned short ftl_crc16(unsigned short crc, const unsigned char *p, size_t len) {
+    while (len--) {
+        crc = (crc << 8) ^ crcTable[((crc >> 8) ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+// Build and send block idx of a transfer of len bytes.
+static int blk_send(struct ftlink *l, const unsigned char *buf, size_t len, unsigned long idx, unsigned long last) {
+    unsigned char frame[FTL_BLK_SIZE + 5];
+    size_t n = 0;
+
+    if (idx < last) {
+        n = len - idx * FTL_BLK_SIZE;
+        if (n > FTL_BLK_SIZE) n = FTL_BLK_SIZE;
+    }
+
+    frame[0] = FTL_BLK_SOH;
+    frame[1] = (unsigned char)idx;
+    frame[2] = (unsigned char)n;
+    memcpy(frame + 3, buf + idx * FTL_BLK_SIZE, n);
+    unsigned short crc = ftl_crc16(0, frame + 1, n + 2);
+    frame[n + 3] = crc >> 8;
+    frame[n + 4] = crc & 0xFF;
+
+    return ftl_write(l, frame, n + 5, -1) == (ssize_t)(n + 5) ? 0 : -1;
+}
+
+// Send a buffer as a sequence of blocks, keeping a window of them in
+// flight and resending only those that are NAKed or time out. The
+// timeout is how long in ms to wait for any acknowledgement.
+ssize_t ftl_blksend(struct ftlink *l, const void *data, size_t len, int timeout) {
+    const unsigned char *buf = data;
+    unsigned long last = (len + FTL_BLK_SIZE - 1) / FTL_BLK_SIZE;
+    unsigned long base = 0, next = 0;
+    unsigned int done = 0;
+    int retries = 0;
+    int state = 0;
+    unsigned char in[256];
+
+    while (base <= last) {
+        while (next < base + FTL_BLK_WINDOW && next <= last) {
+            if (blk_send(l, buf, len, next++, last) != 0) return -1;
+        }
+
+        ssize_t n = ftl_read(l, in, sizeof(in), timeout);
+        if (n < 0) return -1;
+        if (n == 0) {
+            if (++retries > FTL_BLK_RETRIES) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            for (unsigned long i = base; i < next; i++) {
+                if ((done & (1 << (i - base))) == 0 && blk_send(l, buf, len, i, last) != 0) return -1;
+            }
+            continue;
+        }
+
+        for (ssize_t i = 0; i < n; i++) {
+            unsigned char c = in[i];
+            if (state == 0) {
+                if (c == FTL_BLK_ACK || c == FTL_BLK_NAK) state = c;
+                continue;
+            }
+
+            unsigned char off = (unsigned char)(c - (unsigned char)base);
+            if (off < FTL_BLK_WINDOW && base + off < next && (done & (1 << off)) == 0) {
+                if (state == FTL_BLK_ACK) {
+                    done |= 1 << off;
+                    retries = 0;
+                    while (done & 1) {
+                        done >>= 1;
+                        base++;
+                    }
+                } else if (blk_send(l, buf, len, base + off, last) != 0) {
+                    return -1;
+                }
+            }
+            state = 0;
+        }
+    }
+    return len;
+}
+
+// Receive a block transfer into a buffer. Returns the number of bytes
+// received once the end of transfer block has arrived and the link has
+// then been quiet for FTL_BLK_QUIET timeouts, so that repeats of the
+// final block caused by a lost ACK still get answered.
+ssize_t ftl_blkrecv(struct ftlink *l, void *data, size_t len, int timeout) {
+    unsigned char *buf = data;
+    unsigned long base = 0, last = ~0UL;
+    unsigned int done = 0;
+    size_t actual = 0;
+    int retries = 0;
+    int quiet = 0;
+    unsigned char in[4096];
+    unsigned char frame[FTL_BLK_SIZE + 4];
+    size_t have = 0;
+
+    for (;;) {
+        ssize_t n = ftl_read(l, in, sizeof(in), timeout);
+        if (n < 0) return -1;
+        if (n == 0) {
+            if (base > last) {
+                if (++quiet >= FTL_BLK_QUIET) break;
+                continue;
+            }
+            if (++retries > FTL_BLK_RETRIES) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            continue;
+        }
+        quiet = 0;
+
+        for (ssize_t i = 0; i < n; i++) {
+            unsigned char c = in[i];
+
+            // Collect seq, len, data and CRC for one block in frame[].
+            if (have == 0) {
+                if (c == FTL_BLK_SOH) have = 1;
+                continue;
+            }
+            frame[have++ - 1] = c;
+            if (have == 3 && frame[1] > FTL_BLK_SIZE) {
+                have = 0;
+                continue;
+            }
+            if (have < 3 || have - 1 < (size_t)frame[1] + 4) continue;
+            have = 0;
+
+            unsigned char seq = frame[0], blen = frame[1];
+            unsigned short crc = (frame[blen + 2] << 8) | frame[blen + 3];
+            unsigned char off = (unsigned char)(seq - (unsigned char)base);
+            unsigned char reply[2] = { FTL_BLK_ACK, seq };
+
+            if (ftl_crc16(0, frame, blen + 2) != crc) {
+                if (off < FTL_BLK_WINDOW && (done & (1 << off)) == 0) {
+                    reply[0] = FTL_BLK_NAK;
+                    if (ftl_write(l, reply, 2, -1) != 2) return -1;
+                }
+                continue;
+            }
+
+            if (off < FTL_BLK_WINDOW) {
+                if ((done & (1 << off)) == 0) {
+                    unsigned long idx = base + off;
+                    if (idx * FTL_BLK_SIZE + blen > len) {
+                        errno = EOVERFLOW;
+                        return -1;
+                    }
+                    if (blen == 0) {
+                        last = idx;
+                    } else {
+                        memcpy(buf + idx * FTL_BLK_SIZE, frame + 2, blen);
+                        if (idx * FTL_BLK_SIZE + blen > actual) actual = idx * FTL_BLK_SIZE + blen;
+                    }
+                    done |= 1 << off;
+                    while (done & 1) {
+                        done >>= 1;
+                        base++;
+                    }
+                }
+            } else if (off < 256 - FTL_BLK_WINDOW) {
+                continue;
+            }
+
+            if (ftl_write(l, reply, 2, -1) != 2) return -1;
+            retries = 0;
+        }
+    }
+    return actual;
+}
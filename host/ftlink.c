@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pty.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "ftlink.h"
+
+// How much we try to move with a single read or splice call. The
+// FT245R itself only buffers a few hundred bytes, but the USB serial
+// driver collects far more than that while we're not looking.
+#define FTL_CHUNK 65536
+
+// Put a tty into raw mode so the line discipline leaves the bytes alone.
+static int ftl_raw(int fd) {
+    struct termios t;
+    if (tcgetattr(fd, &t) != 0) {
+        return -1;
+    }
+    cfmakeraw(&t);
+    return tcsetattr(fd, TCSANOW, &t);
+}
+
+int ftl_open(struct ftlink *l, const char *path) {
+    struct epoll_event ev;
+
+    l->ft_Fd = -1;
+    l->ft_Slave = -1;
+    l->ft_Epoll = -1;
+    l->ft_Name[0] = 0;
+
+    if (strcmp(path, FTL_PTY) == 0) {
+        // The slave end is held open for the lifetime of the link,
+        // otherwise the master reads EIO whenever the peer closes it.
+        if (openpty(&l->ft_Fd, &l->ft_Slave, l->ft_Name, NULL, NULL) != 0) {
+            return -1;
+        }
+        if (ftl_raw(l->ft_Slave) != 0) {
+            goto fail;
+        }
+    } else {
+        l->ft_Fd = open(path, O_RDWR | O_NOCTTY);
+        if (l->ft_Fd < 0) {
+            return -1;
+        }
+        if (isatty(l->ft_Fd) && ftl_raw(l->ft_Fd) != 0) {
+            goto fail;
+        }
+        snprintf(l->ft_Name, sizeof(l->ft_Name), "%s", path);
+    }
+
+    if (fcntl(l->ft_Fd, F_SETFL, fcntl(l->ft_Fd, F_GETFL) | O_NONBLOCK) != 0) {
+        goto fail;
+    }
+
+    l->ft_Epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (l->ft_Epoll < 0) {
+        goto fail;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (epoll_ctl(l->ft_Epoll, EPOLL_CTL_ADD, l->ft_Fd, &ev) != 0) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    ftl_close(l);
+    return -1;
+}
+
+void ftl_close(struct ftlink *l) {
+    if (l->ft_Epoll >= 0) close(l->ft_Epoll);
+    if (l->ft_Slave >= 0) close(l->ft_Slave);
+    if (l->ft_Fd >= 0) close(l->ft_Fd);
+    l->ft_Epoll = l->ft_Slave = l->ft_Fd = -1;
+}
+
+// Block until the link is ready for any of the given EPOLLIN / EPOLLOUT
+// events, or the timeout (in ms, -1 for ever) expires. Returns the
+// ready events, 0 on timeout or -1 on error.
+int ftl_wait(struct ftlink *l, unsigned int events, int timeout) {
+    struct epoll_event ev;
+    int r;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    if (epoll_ctl(l->ft_Epoll, EPOLL_CTL_MOD, l->ft_Fd, &ev) != 0) {
+        return -1;
+    }
+
+    do {
+        r = epoll_wait(l->ft_Epoll, &ev, 1, timeout);
+    } while (r < 0 && errno == EINTR);
+
+    if (r <= 0) return r;
+    return ev.events;
+}
+
+// Wait for data to arrive then take as much of it as will fit in one
+// go. Returns the number of bytes read, 0 on timeout or -1 on error.
+ssize_t ftl_read(struct ftlink *l, void *buf, size_t len, int timeout) {
+    size_t got = 0;
+
+    int r = ftl_wait(l, EPOLLIN, timeout);
+    if (r <= 0) return r;
+
+    while (got < len) {
+        ssize_t n = read(l->ft_Fd, (char *)buf + got, len - got);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            return got > 0 ? (ssize_t)got : -1;
+        }
+        if (n == 0) break;
+        got += n;
+    }
+    return got;
+}
+
+// Write the whole buffer, sleeping in epoll whenever the kernel side
+// is full. A short count means the timeout expired between writes.
+ssize_t ftl_write(struct ftlink *l, const void *buf, size_t len, int timeout) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = write(l->ft_Fd, (const char *)buf + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) return -1;
+            int r = ftl_wait(l, EPOLLOUT, timeout);
+            if (r < 0) return -1;
+            if (r == 0) break;
+            continue;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// Fallback for kernels or drivers that won't splice from a tty.
+static ssize_t ftl_copy(struct ftlink *l, int out, size_t max, int idle) {
+    static char buf[FTL_CHUNK];
+    size_t total = 0;
+
+    while (max == 0 || total < max) {
+        size_t want = sizeof(buf);
+        if (max != 0 && max - total < want) want = max - total;
+
+        ssize_t n = ftl_read(l, buf, want, idle);
+        if (n < 0) return -1;
+        if (n == 0) break;
+
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(out, buf + off, n - off);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            off += w;
+        }
+        total += n;
+    }
+    return total;
+}
+
+// Move incoming data straight into a file descriptor through a pipe
+// without it passing through user space. Stops after max bytes (0 for
+// no limit) or once the link has been idle for the given time in ms.
+// Returns the number of bytes moved or -1 on error.
+ssize_t ftl_splice(struct ftlink *l, int out, size_t max, int idle) {
+    int p[2];
+    size_t total = 0;
+
+    if (pipe2(p, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    fcntl(p[0], F_SETPIPE_SZ, FTL_CHUNK);
+
+    while (max == 0 || total < max) {
+        size_t want = FTL_CHUNK;
+        if (max != 0 && max - total < want) want = max - total;
+
+        int r = ftl_wait(l, EPOLLIN, idle);
+        if (r < 0) goto fail;
+        if (r == 0) break;
+
+        ssize_t n = splice(l->ft_Fd, NULL, p[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            if (errno == EINVAL && total == 0) {
+                close(p[0]);
+                close(p[1]);
+                return ftl_copy(l, out, max, idle);
+            }
+            goto fail;
+        }
+        if (n == 0) break;
+
+        // Drain the pipe completely before going back for more.
+        while (n > 0) {
+            ssize_t w = splice(p[0], NULL, out, NULL, n, SPLICE_F_MOVE);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                goto fail;
+            }
+            n -= w;
+            total += w;
+        }
+    }
+
+    close(p[0]);
+    close(p[1]);
+    return total;
+
+fail:
+    close(p[0]);
+    close(p[1]);
+    return total > 0 ? (ssize_t)total : -1;
+}
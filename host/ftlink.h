@@ -0,0 +1,43 @@
+#ifndef _FTLINK_H
+#define _FTLINK_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Linux side of the um245r link. The FT245R shows up on the host as
+// a /dev/ttyUSB* device; everything here treats it as a raw byte pipe
+// driven through epoll with the descriptor in non-blocking mode.
+
+// Passing this as the device path creates a pty pair instead. The
+// link talks to the master end and the slave path is reported in
+// ft_Name so that a second process can stand in for the Amiga.
+#define FTL_PTY "pty"
+
+// Block framing used by the driver's FTCMD_BLKREAD / FTCMD_BLKWRITE.
+// These must match um245r.h.
+#define FTL_BLK_SOH 0x01
+#define FTL_BLK_ACK 0x06
+#define FTL_BLK_NAK 0x15
+#define FTL_BLK_SIZE 128
+#define FTL_BLK_WINDOW 8
+
+struct ftlink {
+    int ft_Fd;
+    int ft_Epoll;
+    int ft_Slave;
+    char ft_Name[64];
+};
+
+int ftl_open(struct ftlink *, const char *);
+void ftl_close(struct ftlink *);
+
+int ftl_wait(struct ftlink *, unsigned int, int);
+ssize_t ftl_read(struct ftlink *, void *, size_t, int);
+ssize_t ftl_write(struct ftlink *, const void *, size_t, int);
+ssize_t ftl_splice(struct ftlink *, int, size_t, int);
+
+unsigned short ftl_crc16(unsigned short, const unsigned char *, size_t);
+ssize_t ftl_blksend(struct ftlink *, const void *, size_t, int);
+ssize_t ftl_blkrecv(struct ftlink *, void *, size_t, int);
+
+#endif
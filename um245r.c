@@ -16,6 +16,11 @@
 #include <dos/dostags.h>
 #include <dos/dosextens.h>
 
+#include <devices/timer.h>
+#include <proto/timer.h>
+
+#include "um245r.h"
+
 #define STR(s) #s
 #define XSTR(s) STR(s)
 
@@ -50,52 +55,191 @@
 // by the software opening the device.
 #define FT_BUFSIZ 64
 
+// How long, in ticks, the comms task and its buffer stay alive after the
+// unit is closed. Zero means the task is killed as soon as the last
+// opener goes. Can be changed at run time with FTCMD_SETLINGER.
+#ifndef FT_LINGER
+#define FT_LINGER 0
+#endif
+
+// Defaults for the comms task tuning, see FTCMD_SETTUNING. Priority of
+// the task, most bytes taken from the FIFO before giving up the CPU for
+// a tick (0 for no limit)
+// and target reply latency in microseconds (0 for none).
+#ifndef FT_PRIORITY
+#define FT_PRIORITY 0
+#endif
+#ifndef FT_QUANTUM
+#define FT_QUANTUM 0
+#endif
+#ifndef FT_LATENCY
+#define FT_LATENCY 0
+#endif
+
+// The quantum is never cut below this when chasing the latency target,
+// or below the configured quantum if that is smaller still.
+#define FT_QUANTUM_MIN 16
+
+// Capture ring defaults. The helper that writes the ring to disk looks
+// every FT_CAPPOLL ticks and writes once FT_CAPCHUNK bytes, or half the
+// ring if that is less, are waiting, or whatever there is after
+// FT_CAPQUIET looks with nothing new. Rings under FT_CAPMIN bytes are
+// refused.
+#define FT_CAPSIZ 65536
+#define FT_CAPMIN 256
+#define FT_CAPCHUNK 8192
+#define FT_CAPPOLL 5
+#define FT_CAPQUIET 10
+
 // Special non-standard commands for controlling the communications tasks.
 #define CMD_KILLPROC (CMD_NONSTD + 50)
 #define CMD_ABORT (CMD_NONSTD + 60)
 #define CMD_ABORT_READ (CMD_ABORT + CMD_READ)
 #define CMD_ABORT_WRITE (CMD_ABORT + CMD_WRITE)
+#define CMD_ABORT_BLOCK (CMD_ABORT + 10)
+#define CMD_CAPTURE_OFF (CMD_NONSTD + 80)
+
+// How many ticks without hearing from the other end before
+// unacknowledged blocks are sent again, and how many times that may
+// happen in a row before a block transfer gives up. The host tool uses
+// the same half second. Once a block read has everything it waits for
+// FT_BLK_QUIET ticks of silence, a few of the sender's resend intervals,
+// before replying.
+#define FT_BLK_TIMEOUT (TICKS_PER_SECOND / 2)
+#define FT_BLK_RETRIES 10
+#define FT_BLK_QUIET (TICKS_PER_SECOND * 2)
+
+// States of the block transfer parser
+#define BLK_HUNT 0
+#define BLK_SEQ 1
+#define BLK_LEN 2
+#define BLK_DATA 3
+#define BLK_CRCH 4
+#define BLK_CRCL 5
+#define BLK_ACK 6
+#define BLK_NAK 7
 
 struct FTUnit {
     struct Unit ft_Unit;
     volatile unsigned char *ft_Status;
     volatile unsigned char *ft_Fifo;
+
+    // The loopback unit has no hardware. Instead anything written is
+    // put in this queue and read back out of it as if it came from the
+    // FT245R's own FIFO.
+    unsigned char *ft_Loop;
+    volatile unsigned short ft_LoopHead;
+    volatile unsigned short ft_LoopTail;
+    unsigned long ft_LoopDropped;
+
     volatile unsigned char *ft_Buffer;
     volatile unsigned long ft_BufferSize;
     volatile unsigned long ft_Head;
     volatile unsigned long ft_Tail;
+    volatile unsigned long ft_Borrowed;
     unsigned long ft_Terminator1;
     unsigned long ft_Terminator2;
     unsigned char ft_Flags;
     struct IOExtSer *ft_Reader;
     struct IOExtSer *ft_Writer;
+    struct IOExtSer *ft_Notify;
+    unsigned long ft_NotifyLength;
     struct Process *ft_Task;
     struct MsgPort *ft_ReadPort;
     struct MsgPort *ft_WritePort;
     struct MsgPort *ft_CommandPort;
+    unsigned long ft_Linger;
+    volatile unsigned char ft_Idle;
+
+    // Tuning. ft_QuantumNow is how much the comms task takes from the
+    // FIFO per pass; it is cut back when replies miss the latency target
+    // and allowed to grow again towards ft_Quantum when they're well
+    // inside it.
+    long ft_Priority;
+    unsigned long ft_Quantum;
+    unsigned long ft_QuantumNow;
+    unsigned long ft_Latency;
+    unsigned long ft_Replies;
+    unsigned long ft_Missed;
+    unsigned long ft_Worst;
+
+    // Capture state. The comms task owns ft_CapHead and the capture
+    // helper owns ft_CapTail, ft_CapFile and ft_CapPort; everything else
+    // is set up before ft_CapOn is raised and left alone until the comms
+    // task has dropped it.
+    unsigned char *ft_Cap;
+    unsigned long ft_CapSize;
+    volatile unsigned long ft_CapHead;
+    volatile unsigned long ft_CapTail;
+    unsigned long ft_CapFlags;
+    unsigned long ft_CapDropped;
+    unsigned long ft_CapWritten;
+    BPTR ft_CapFile;
+    struct Process *ft_CapTask;
+    struct MsgPort *ft_CapPort;
+    volatile unsigned char ft_CapOn;
+
+    // Block transfer state. For a write ft_BlkBase is the oldest block
+    // not yet acknowledged and ft_BlkNext the next one to send for the
+    // first time. For a read ft_BlkBase is the next block expected in
+    // order. Bit n of ft_BlkDone is set once block ft_BlkBase + n has
+    // been acknowledged (write) or received intact (read).
+    struct IOExtSer *ft_Block;
+    unsigned long ft_BlkBase;
+    unsigned long ft_BlkNext;
+    unsigned long ft_BlkLast;
+    struct DateStamp ft_BlkHeard;
+    unsigned char ft_BlkRetries;
+    unsigned char ft_BlkDone;
+    unsigned char ft_BlkState;
+    unsigned char ft_BlkSeq;
+    unsigned char ft_BlkLen;
+    unsigned char ft_BlkPos;
+    unsigned short ft_BlkCrc;
+    unsigned short ft_BlkRxCrc;
+    unsigned char *ft_BlkDst;
 };
 
-struct FTUnit units[1] = {
-    { .ft_Status = FT_BASE, .ft_Fifo = FT_BASE + 1 }
+unsigned char loopQueue[FT_LOOP_SIZE];
+
+struct FTUnit units[2] = {
+    { .ft_Status = FT_BASE, .ft_Fifo = FT_BASE + 1, .ft_Linger = FT_LINGER,
+      .ft_Priority = FT_PRIORITY, .ft_Quantum = FT_QUANTUM, .ft_Latency = FT_LATENCY },
+    { .ft_Loop = loopQueue, .ft_Linger = FT_LINGER,
+      .ft_Priority = FT_PRIORITY, .ft_Quantum = FT_QUANTUM, .ft_Latency = FT_LATENCY }
 };
 
 #define NUM_UNITS (sizeof(units) / sizeof(units[0]))
 
 unsigned long ft_Available(struct FTUnit *);
+int ft_HasTerminator(struct FTUnit *);
 int ft_Read(struct FTUnit *);
 void writeChar(struct FTUnit *, const char);
+static inline unsigned char ft_StatusReg(struct FTUnit *);
+static inline unsigned char ft_FifoRead(struct FTUnit *);
 int ft_SetDefaultOptions(struct FTUnit *);
+void ft_SetDefaultFlags(struct FTUnit *);
+void ft_EndNotify(struct FTUnit *, int);
+void ft_BlkStart(struct FTUnit *);
+void ft_BlkService(struct FTUnit *);
 
 
 
 void syncMsg(struct FTUnit *, unsigned long);
 
 void commsManager();
+void captureManager();
+int ft_StartCapture(struct FTUnit *, struct FTCapture *);
+long ft_CapPriority(struct FTUnit *);
+void ft_StopCapture(struct FTUnit *, struct FTCapture *);
 inline int isTerminator(struct FTUnit *u, char c);
 
 
 struct ExecBase *SysBase;
 struct DosLibrary *DOSBase;
+struct Device *TimerBase;
+struct timerequest eclockReq;
+unsigned long eclockKHz;
 BPTR saved_seg_list;
 
 /*-----------------------------------------------------------
@@ -161,6 +305,15 @@ static struct Library __attribute__((used)) * init_device(BPTR seg_list asm("a0"
     SysBase = *(struct ExecBase **)4UL;
     DOSBase  = (struct DosLibrary *) OpenLibrary("dos.library",0);
 
+    /* The EClock gives the comms tasks something fine enough to measure
+       reply times with. Without it everything still works, there just
+       aren't any figures. One opening is shared by all the units. */
+    if (OpenDevice(TIMERNAME, UNIT_ECLOCK, &eclockReq.tr_node, 0) == 0) {
+        struct EClockVal ev;
+        TimerBase = eclockReq.tr_node.io_Device;
+        eclockKHz = ReadEClock(&ev) / 1000;
+    }
+
     /* save pointer to our loaded code (the SegList) */
     saved_seg_list = seg_list;
 
@@ -185,6 +338,26 @@ static BPTR __attribute__((used)) expunge(struct Library *dev asm("a6")) {
         return 0;
     }
 
+    // A comms task lingering after the last close is still running our
+    // code. Cut its linger short so that it goes away on its next pass,
+    // and leave the expunge to be tried again after that.
+    int lingering = 0;
+    for (unsigned long i = 0; i < NUM_UNITS; i++) {
+        if (units[i].ft_Task != NULL) {
+            units[i].ft_Linger = 0;
+            lingering = 1;
+        }
+    }
+    if (lingering) {
+        dev->lib_Flags |= LIBF_DELEXP;
+        return 0;
+    }
+
+    if (TimerBase != NULL) {
+        CloseDevice(&eclockReq.tr_node);
+        TimerBase = NULL;
+    }
+
     BPTR seg_list = saved_seg_list;
     Remove(&dev->lib_Node);
     FreeMem((char *)dev - dev->lib_NegSize, dev->lib_NegSize + dev->lib_PosSize);
@@ -207,12 +380,6 @@ static void __attribute__((used)) open(struct Library *dev asm("a6"), struct IOR
 
     struct FTUnit *thisUnit = &units[unitnum];
 
-    if (thisUnit != &units[0]) {
-        sreq->IOSer.io_Error = IOERR_OPENFAIL;
-        sreq->IOSer.io_Message.mn_Node.ln_Type = NT_REPLYMSG;
-        return;
-    }
-
     if (thisUnit->ft_Unit.unit_OpenCnt != 0) {
         sreq->IOSer.io_Error = IOERR_UNITBUSY;
         sreq->IOSer.io_Message.mn_Node.ln_Type = NT_REPLYMSG;
@@ -221,6 +388,23 @@ static void __attribute__((used)) open(struct Library *dev asm("a6"), struct IOR
 
     thisUnit->ft_Unit.unit_OpenCnt++;
 
+    // If the comms task is still lingering from the last close we can
+    // just take it back. The buffer and anything that arrived in the
+    // meantime are kept; only the flags go back to their defaults.
+    // The task only gives up under Forbid() after checking ft_Idle, so
+    // clearing it here can't race with that.
+    if (thisUnit->ft_Task != NULL) {
+        thisUnit->ft_Idle = 0;
+        thisUnit->ft_Borrowed = 0;
+        ft_SetDefaultFlags(thisUnit);
+
+        ioreq->io_Unit = (struct Unit *)thisUnit;
+        dev->lib_OpenCnt++;
+        sreq->IOSer.io_Error = 0; 
+        sreq->IOSer.io_Message.mn_Node.ln_Type = NT_REPLYMSG;
+        return;
+    }
+
     thisUnit->ft_Buffer = NULL;
 
     int r = ft_SetDefaultOptions(thisUnit);
@@ -233,6 +417,8 @@ static void __attribute__((used)) open(struct Library *dev asm("a6"), struct IOR
 
     thisUnit->ft_Writer = NULL;
     thisUnit->ft_Reader = NULL;
+    thisUnit->ft_Block = NULL;
+    thisUnit->ft_Notify = NULL;
     thisUnit->ft_ReadPort = NULL;
     thisUnit->ft_WritePort = NULL;
     thisUnit->ft_CommandPort = NULL;
@@ -240,10 +426,14 @@ static void __attribute__((used)) open(struct Library *dev asm("a6"), struct IOR
     thisUnit->ft_Task = CreateNewProcTags(
         NP_Name, (unsigned long)"FT245R Comms Server",
         NP_Entry, (unsigned long)commsManager,
+        NP_Priority, (unsigned long)thisUnit->ft_Priority,
         TAG_END
     );
 
     if (thisUnit->ft_Task == NULL) {
+        thisUnit->ft_Unit.unit_OpenCnt--;
+        FreeMem((char *)thisUnit->ft_Buffer, thisUnit->ft_BufferSize);
+        thisUnit->ft_Buffer = NULL;
         sreq->IOSer.io_Error = IOERR_OPENFAIL;
         sreq->IOSer.io_Message.mn_Node.ln_Type = NT_REPLYMSG;
         return;
@@ -285,15 +475,25 @@ static BPTR __attribute__((used)) close(struct Library *dev asm("a6"), struct IO
     dev->lib_OpenCnt--;
 
     if (thisUnit->ft_Unit.unit_OpenCnt == 0) {
-        syncMsg(thisUnit, CMD_KILLPROC);
+        ft_StopCapture(thisUnit, NULL);
+        ft_EndNotify(thisUnit, IOERR_ABORTED);
+
+        if (thisUnit->ft_Linger != 0) {
+            // Leave the comms task running on its own. It keeps filling
+            // the buffer and tidies itself away once the linger time is
+            // up, unless someone opens the unit again first.
+            thisUnit->ft_Idle = 1;
+        } else {
+            syncMsg(thisUnit, CMD_KILLPROC);
+
+            while (thisUnit->ft_CommandPort != NULL) {
+                Delay(1);
+            }
 
-        while (thisUnit->ft_CommandPort != NULL) {
-            Delay(1);
+            thisUnit->ft_Task = NULL;
+            FreeMem((char *)thisUnit->ft_Buffer, thisUnit->ft_BufferSize);
+            thisUnit->ft_Buffer = NULL;
         }
-
-        FreeMem((char *)thisUnit->ft_Buffer, thisUnit->ft_BufferSize);
-
-        
     }
 
     if (dev->lib_OpenCnt == 0 && (dev->lib_Flags & LIBF_DELEXP))
@@ -317,6 +517,8 @@ static void __attribute__((used)) begin_io(struct Library *dev asm("a6"), struct
         case CMD_RESET:
             syncMsg(thisUnit, CMD_ABORT_WRITE);
             syncMsg(thisUnit, CMD_ABORT_READ);
+            syncMsg(thisUnit, CMD_ABORT_BLOCK);
+            ft_EndNotify(thisUnit, IOERR_ABORTED);
             i = ft_SetDefaultOptions(thisUnit);
             if (i != 0) {
                 sreq->IOSer.io_Error = i;
@@ -357,6 +559,14 @@ static void __attribute__((used)) begin_io(struct Library *dev asm("a6"), struct
             // here would not have any benefit. Instead we'll just submit the
             // request to the unit and return.
             //DBG("Queueing read %ld\r\n", sreq->IOSer.io_Length);
+            // Note when the read was sent so that time spent waiting for
+            // the comms task counts towards its latency. io_Actual is ours
+            // until the reply, and the comms task clears it when it starts.
+            if (TimerBase != NULL) {
+                struct EClockVal ev;
+                ReadEClock(&ev);
+                sreq->IOSer.io_Actual = ev.ev_lo;
+            }
             sreq->IOSer.io_Flags &= ~IOF_QUICK;
             PutMsg(thisUnit->ft_ReadPort, &sreq->IOSer.io_Message);
             return;
@@ -399,8 +609,13 @@ static void __attribute__((used)) begin_io(struct Library *dev asm("a6"), struct
         
         case CMD_CLEAR:
             // Here we'll just zap the head and tail of the circular
-            // buffer and convert it to a quick call.
-            thisUnit->ft_Head = thisUnit->ft_Tail = 0;
+            // buffer and convert it to a quick call. Not while some of
+            // it is borrowed though, since that has to stay put.
+            if (thisUnit->ft_Borrowed != 0) {
+                sreq->IOSer.io_Error = SerErr_DevBusy;
+            } else {
+                thisUnit->ft_Head = thisUnit->ft_Tail = 0;
+            }
             sreq->IOSer.io_Flags |= IOF_QUICK;
             ReplyMsg(&sreq->IOSer.io_Message);
             return;
@@ -419,7 +634,11 @@ static void __attribute__((used)) begin_io(struct Library *dev asm("a6"), struct
 
         case CMD_FLUSH:
             // Flush is the same as Clear.
-            thisUnit->ft_Head = thisUnit->ft_Tail = 0;
+            if (thisUnit->ft_Borrowed != 0) {
+                sreq->IOSer.io_Error = SerErr_DevBusy;
+            } else {
+                thisUnit->ft_Head = thisUnit->ft_Tail = 0;
+            }
             sreq->IOSer.io_Flags |= IOF_QUICK;
             ReplyMsg(&sreq->IOSer.io_Message);
             return;
@@ -433,10 +652,10 @@ static void __attribute__((used)) begin_io(struct Library *dev asm("a6"), struct
                 (0 << 2) | // RI
                 (0 << 3) | // DSR
                 (0 << 4) | // CTS
-                ((*thisUnit->ft_Status & FT_PWE) ? 1 << 5 : 0) | // CD
-                ((*thisUnit->ft_Status & FT_TXE) ? 1 << 6 : 0) | // RTS
-                ((*thisUnit->ft_Status & FT_TXE) ? 1 << 7 : 0) | // DTR
-                (0 << 8) | // Read Overrun
+                ((ft_StatusReg(thisUnit) & FT_PWE) ? 1 << 5 : 0) | // CD
+                ((ft_StatusReg(thisUnit) & FT_TXE) ? 1 << 6 : 0) | // RTS
+                ((ft_StatusReg(thisUnit) & FT_TXE) ? 1 << 7 : 0) | // DTR
+                (thisUnit->ft_LoopDropped ? 1 << 8 : 0) | // Read Overrun
                 (0 << 9) | // Break Sent
                 (0 << 10) | // Break Received
                 (0 << 11) | // Transmit x-OFFed
@@ -445,6 +664,9 @@ static void __attribute__((used)) begin_io(struct Library *dev asm("a6"), struct
                 (0 << 14) | // Reserved
                 (0 << 15) // Reserved
             );
+            // Only the loopback unit can lose bytes on the way in. The
+            // overrun bit says whether it has since the last query.
+            thisUnit->ft_LoopDropped = 0;
             sreq->IOSer.io_Actual = ft_Available(thisUnit);
             sreq->IOSer.io_Flags |= IOF_QUICK;
             DBG("SDCMD_QUERY -> %lu\r\n", sreq->IOSer.io_Actual);
@@ -462,6 +684,12 @@ static void __attribute__((used)) begin_io(struct Library *dev asm("a6"), struct
             // If a new buffer size has been requested then zap the old one
             // and allocate a new one. At the moment bad things will happen
             // if there isn't enough memory to allocate.
+            if (sreq->io_RBufLen != thisUnit->ft_BufferSize && thisUnit->ft_Borrowed != 0) {
+                sreq->IOSer.io_Error = SerErr_DevBusy;
+                sreq->IOSer.io_Flags |= IOF_QUICK;
+                ReplyMsg(&sreq->IOSer.io_Message);
+                return;
+            }
             if (sreq->io_RBufLen != thisUnit->ft_BufferSize) {
                 FreeMem((char *)thisUnit->ft_Buffer, thisUnit->ft_BufferSize);
                 thisUnit->ft_Head = thisUnit->ft_Tail = 0;
@@ -486,6 +714,157 @@ static void __attribute__((used)) begin_io(struct Library *dev asm("a6"), struct
             ReplyMsg(&sreq->IOSer.io_Message);
             return;
 
+        case FTCMD_BLKREAD:
+        case FTCMD_BLKWRITE:
+            // Block transfers queue up behind normal reads since both
+            // need to own the incoming data stream while they run.
+            sreq->IOSer.io_Flags &= ~IOF_QUICK;
+            PutMsg(thisUnit->ft_ReadPort, &sreq->IOSer.io_Message);
+            return;
+
+        case FTCMD_BORROW:
+            // Hand out the readable part of the ring as up to two spans.
+            // Nothing can move the tail until they're released: the comms
+            // task won't start a read or block transfer while anything
+            // is borrowed, and it only ever writes past the head.
+            Forbid();
+            if (thisUnit->ft_Reader != NULL || thisUnit->ft_Block != NULL) {
+                Permit();
+                sreq->IOSer.io_Error = SerErr_DevBusy;
+                sreq->IOSer.io_Flags |= IOF_QUICK;
+                ReplyMsg(&sreq->IOSer.io_Message);
+                return;
+            }
+            {
+                struct FTSpans *spans = (struct FTSpans *)sreq->IOSer.io_Data;
+                unsigned long head = thisUnit->ft_Head;
+                unsigned long tail = thisUnit->ft_Tail;
+                unsigned char *buf = (unsigned char *)thisUnit->ft_Buffer;
+
+                if (head >= tail) {
+                    spans->fs_Data[0] = buf + tail;
+                    spans->fs_Length[0] = head - tail;
+                    spans->fs_Data[1] = NULL;
+                    spans->fs_Length[1] = 0;
+                } else {
+                    spans->fs_Data[0] = buf + tail;
+                    spans->fs_Length[0] = thisUnit->ft_BufferSize - tail;
+                    spans->fs_Data[1] = buf;
+                    spans->fs_Length[1] = head;
+                }
+                thisUnit->ft_Borrowed = spans->fs_Length[0] + spans->fs_Length[1];
+                sreq->IOSer.io_Actual = thisUnit->ft_Borrowed;
+            }
+            Permit();
+            sreq->IOSer.io_Flags |= IOF_QUICK;
+            ReplyMsg(&sreq->IOSer.io_Message);
+            return;
+
+        case FTCMD_RELEASE:
+            // Give back the first io_Length bytes of what was borrowed.
+            Forbid();
+            if (sreq->IOSer.io_Length > thisUnit->ft_Borrowed) {
+                sreq->IOSer.io_Error = SerErr_InvParam;
+            } else {
+                thisUnit->ft_Tail = (thisUnit->ft_Tail + sreq->IOSer.io_Length) % thisUnit->ft_BufferSize;
+                thisUnit->ft_Borrowed -= sreq->IOSer.io_Length;
+                sreq->IOSer.io_Actual = sreq->IOSer.io_Length;
+            }
+            Permit();
+            sreq->IOSer.io_Flags |= IOF_QUICK;
+            ReplyMsg(&sreq->IOSer.io_Message);
+            return;
+
+        case FTCMD_NOTIFY:
+            // Hang on to the request until the buffer holds io_Length bytes
+            // or a terminator comes in. If there's enough already it goes
+            // straight back.
+            // The buffer never holds more than ft_BufferSize - 1 bytes,
+            // so asking for that many or more would wait for ever.
+            // The threshold is kept in the unit since the comms task
+            // can't safely look at a request that may be aborted.
+            Forbid();
+            if (thisUnit->ft_Notify != NULL) {
+                sreq->IOSer.io_Error = SerErr_DevBusy;
+            } else if (sreq->IOSer.io_Length >= thisUnit->ft_BufferSize) {
+                sreq->IOSer.io_Error = SerErr_InvParam;
+            } else {
+                // A line that is already complete counts as enough too,
+                // or a client re-arming after each line could sleep on one.
+                i = (thisUnit->ft_BufferSize + thisUnit->ft_Head - thisUnit->ft_Tail) % thisUnit->ft_BufferSize;
+                if (i == 0 || (i < sreq->IOSer.io_Length && !ft_HasTerminator(thisUnit))) {
+                    sreq->IOSer.io_Flags &= ~IOF_QUICK;
+                    thisUnit->ft_NotifyLength = sreq->IOSer.io_Length;
+                    thisUnit->ft_Notify = sreq;
+                    Permit();
+                    return;
+                }
+                sreq->IOSer.io_Actual = i;
+            }
+            Permit();
+            sreq->IOSer.io_Flags |= IOF_QUICK;
+            ReplyMsg(&sreq->IOSer.io_Message);
+            return;
+
+        case FTCMD_CAPTURE:
+            // Start or stop mirroring everything received into a file.
+            if (((struct FTCapture *)sreq->IOSer.io_Data)->fc_File != NULL) {
+                sreq->IOSer.io_Error = ft_StartCapture(thisUnit, (struct FTCapture *)sreq->IOSer.io_Data);
+            } else {
+                ft_StopCapture(thisUnit, (struct FTCapture *)sreq->IOSer.io_Data);
+            }
+            sreq->IOSer.io_Flags |= IOF_QUICK;
+            ReplyMsg(&sreq->IOSer.io_Message);
+            return;
+
+        case FTCMD_SETTUNING:
+            // New settings take effect straight away and start a fresh
+            // set of latency figures.
+            {
+                struct FTTuning *tn = (struct FTTuning *)sreq->IOSer.io_Data;
+                if (tn->tn_Priority < -128 || tn->tn_Priority > 127) {
+                    sreq->IOSer.io_Error = SerErr_InvParam;
+                } else {
+                    thisUnit->ft_Priority = tn->tn_Priority;
+                    thisUnit->ft_Quantum = tn->tn_Quantum;
+                    thisUnit->ft_QuantumNow = tn->tn_Quantum ? tn->tn_Quantum : ~0UL;
+                    thisUnit->ft_Latency = tn->tn_Latency;
+                    thisUnit->ft_Replies = thisUnit->ft_Missed = thisUnit->ft_Worst = 0;
+                    SetTaskPri(&thisUnit->ft_Task->pr_Task, thisUnit->ft_Priority);
+                    // The capture helper could be on its way out.
+                    Forbid();
+                    if (thisUnit->ft_CapTask != NULL) {
+                        SetTaskPri(&thisUnit->ft_CapTask->pr_Task, ft_CapPriority(thisUnit));
+                    }
+                    Permit();
+                }
+            }
+            sreq->IOSer.io_Flags |= IOF_QUICK;
+            ReplyMsg(&sreq->IOSer.io_Message);
+            return;
+
+        case FTCMD_GETTUNING:
+            {
+                struct FTTuning *tn = (struct FTTuning *)sreq->IOSer.io_Data;
+                tn->tn_Priority = thisUnit->ft_Priority;
+                tn->tn_Quantum = thisUnit->ft_Quantum;
+                tn->tn_Latency = thisUnit->ft_Latency;
+                tn->tn_QuantumNow = thisUnit->ft_QuantumNow;
+                tn->tn_Replies = thisUnit->ft_Replies;
+                tn->tn_Missed = thisUnit->ft_Missed;
+                tn->tn_Worst = thisUnit->ft_Worst;
+            }
+            sreq->IOSer.io_Flags |= IOF_QUICK;
+            ReplyMsg(&sreq->IOSer.io_Message);
+            return;
+
+        case FTCMD_SETLINGER:
+            // Set how long the comms task outlives the last close, in ticks.
+            thisUnit->ft_Linger = sreq->IOSer.io_Length;
+            sreq->IOSer.io_Flags |= IOF_QUICK;
+            ReplyMsg(&sreq->IOSer.io_Message);
+            return;
+
         default:
             // We don't know what the request was here, so we'll
             // just pretend like we did it and did it "quick".
@@ -501,6 +880,26 @@ static ULONG __attribute__((used)) abort_io(struct Library *dev asm("a6"), struc
     sreq->IOSer.io_Flags |= IOF_QUICK;
     struct FTUnit *thisUnit = (struct FTUnit *)ioreq->io_Unit;
 
+    if (sreq == thisUnit->ft_Notify) {
+        ft_EndNotify(thisUnit, IOERR_ABORTED);
+        return 0;
+    }
+
+    // A request still waiting in one of the unit's ports hasn't been
+    // looked at by the comms task yet, so we can just pull it out and
+    // send it back. The one the task is working on has been taken off
+    // the port already but isn't replied yet, so it is left alone here.
+    Forbid();
+    if (sreq->IOSer.io_Message.mn_Node.ln_Type == NT_MESSAGE && sreq != thisUnit->ft_Reader && sreq != thisUnit->ft_Block) {
+        Remove(&sreq->IOSer.io_Message.mn_Node);
+        sreq->IOSer.io_Actual = 0;
+        sreq->IOSer.io_Error = IOERR_ABORTED;
+        ReplyMsg(&sreq->IOSer.io_Message);
+        Permit();
+        return 0;
+    }
+    Permit();
+
     switch (sreq->IOSer.io_Command) {
         case CMD_READ:
             syncMsg(thisUnit, CMD_ABORT_READ);
@@ -508,6 +907,10 @@ static ULONG __attribute__((used)) abort_io(struct Library *dev asm("a6"), struc
         case CMD_WRITE:
             syncMsg(thisUnit, CMD_ABORT_WRITE);
             break;
+        case FTCMD_BLKREAD:
+        case FTCMD_BLKWRITE:
+            syncMsg(thisUnit, CMD_ABORT_BLOCK);
+            break;
     }
     
 
@@ -576,6 +979,169 @@ void syncMsg(struct FTUnit *u, unsigned long command) {
     DeleteMsgPort(msg.IOSer.io_Message.mn_ReplyPort);
 }
 
+// Send a message to the capture helper and block waiting for a reply.
+// The first one gives it the unit and the name of the file to open;
+// after that an empty one tells it to finish up and go.
+static int capMsg(struct FTUnit *u, struct MsgPort *port, STRPTR file) {
+    struct IOExtSer msg;
+
+    msg.IOSer.io_Message.mn_ReplyPort = CreateMsgPort();
+    msg.IOSer.io_Unit = (struct Unit *)u;
+    msg.IOSer.io_Data = file;
+    msg.IOSer.io_Error = 0;
+    PutMsg(port, &msg.IOSer.io_Message);
+    WaitPort(msg.IOSer.io_Message.mn_ReplyPort);
+    GetMsg(msg.IOSer.io_Message.mn_ReplyPort);
+    DeleteMsgPort(msg.IOSer.io_Message.mn_ReplyPort);
+    return msg.IOSer.io_Error;
+}
+
+// The priority the capture helper runs at. The comms task spins while
+// the unit is busy and only gives up the CPU when it's idle with a
+// latency target of a tick or more, or after each quantum of incoming
+// data. Only in the last case is it sure to let a lower priority helper
+// run while there's data to capture, so the helper goes one below it
+// then and shares its priority otherwise. Either way the data path is
+// never held up: if the disk can't keep up the ring fills and bursts
+// are dropped.
+long ft_CapPriority(struct FTUnit *u) {
+    if (u->ft_Quantum != 0 && u->ft_Priority > -128) {
+        return u->ft_Priority - 1;
+    }
+    return u->ft_Priority;
+}
+
+// Set up the capture ring and start the helper that writes it out.
+// This runs in the caller's context, which needn't be a process, so
+// the file itself is opened and closed by the helper.
+int ft_StartCapture(struct FTUnit *u, struct FTCapture *cap) {
+    if (u->ft_CapTask != NULL) {
+        return SerErr_DevBusy;
+    }
+
+    if (cap->fc_Size != 0 && cap->fc_Size < FT_CAPMIN) {
+        return SerErr_InvParam;
+    }
+
+    u->ft_CapSize = cap->fc_Size ? cap->fc_Size : FT_CAPSIZ;
+    u->ft_Cap = AllocMem(u->ft_CapSize, MEMF_PUBLIC);
+    if (u->ft_Cap == NULL) {
+        return SerErr_BufErr;
+    }
+
+    u->ft_CapHead = u->ft_CapTail = 0;
+    u->ft_CapFlags = cap->fc_Flags;
+    u->ft_CapDropped = 0;
+    u->ft_CapWritten = 0;
+
+    u->ft_CapTask = CreateNewProcTags(
+        NP_Name, (unsigned long)"FT245R Capture",
+        NP_Entry, (unsigned long)captureManager,
+        NP_Priority, (unsigned long)ft_CapPriority(u),
+        TAG_END
+    );
+
+    if (u->ft_CapTask == NULL) {
+        FreeMem(u->ft_Cap, u->ft_CapSize);
+        u->ft_Cap = NULL;
+        return IOERR_OPENFAIL;
+    }
+
+    // If the file can't be opened the helper is already gone by the
+    // time we get the reply.
+    if (capMsg(u, &u->ft_CapTask->pr_MsgPort, cap->fc_File) != 0) {
+        FreeMem(u->ft_Cap, u->ft_CapSize);
+        u->ft_Cap = NULL;
+        return IOERR_OPENFAIL;
+    }
+
+    u->ft_CapOn = 1;
+    return 0;
+}
+
+// Stop a capture, if there is one running, and report how it went.
+void ft_StopCapture(struct FTUnit *u, struct FTCapture *cap) {
+    if (u->ft_CapTask != NULL) {
+        // Make sure the comms task is done with the ring, then let the
+        // helper write out what's left, close the file and go.
+        syncMsg(u, CMD_CAPTURE_OFF);
+        capMsg(u, u->ft_CapPort, NULL);
+
+        FreeMem(u->ft_Cap, u->ft_CapSize);
+        u->ft_Cap = NULL;
+    }
+
+    if (cap != NULL) {
+        cap->fc_Written = u->ft_CapWritten;
+        cap->fc_Dropped = u->ft_CapDropped;
+    }
+}
+
+// Copy a piece of data into the capture ring.
+static void capPut(struct FTUnit *u, const void *data, unsigned long len) {
+    unsigned long head = u->ft_CapHead;
+    unsigned long room = u->ft_CapSize - head;
+
+    if (len > room) {
+        CopyMem((APTR)data, u->ft_Cap + head, room);
+        CopyMem((APTR)((const char *)data + room), u->ft_Cap, len - room);
+        head = len - room;
+    } else {
+        CopyMem((APTR)data, u->ft_Cap + head, len);
+        head += len;
+        if (head == u->ft_CapSize) head = 0;
+    }
+    u->ft_CapHead = head;
+}
+
+// Mirror the bytes the comms task just stored, from position from up
+// to the head of the RX buffer, into the capture ring. If they won't
+// all fit the whole burst is dropped rather than waiting for the disk.
+static void capBurst(struct FTUnit *u, unsigned long from) {
+    unsigned long head = u->ft_Head;
+    unsigned long len = (u->ft_BufferSize + head - from) % u->ft_BufferSize;
+    unsigned long need = len;
+    unsigned long room = (u->ft_CapSize + u->ft_CapTail - u->ft_CapHead - 1) % u->ft_CapSize;
+    struct FTCaptureHeader hdr;
+
+    if (u->ft_CapFlags & FTCAPF_TIMESTAMP) {
+        need += sizeof(hdr);
+    }
+
+    if (need > room) {
+        u->ft_CapDropped += len;
+        return;
+    }
+
+    if (u->ft_CapFlags & FTCAPF_TIMESTAMP) {
+        DateStamp(&hdr.ch_Time);
+        hdr.ch_Length = len;
+        capPut(u, &hdr, sizeof(hdr));
+    }
+
+    if (head >= from) {
+        capPut(u, (const void *)(u->ft_Buffer + from), len);
+    } else {
+        capPut(u, (const void *)(u->ft_Buffer + from), u->ft_BufferSize - from);
+        capPut(u, (const void *)u->ft_Buffer, head);
+    }
+}
+
+// Send back the pending FTCMD_NOTIFY request, if there is one, with
+// io_Actual set to how much is in the buffer right now.
+void ft_EndNotify(struct FTUnit *u, int error) {
+    Forbid();
+    struct IOExtSer *req = u->ft_Notify;
+    u->ft_Notify = NULL;
+    Permit();
+
+    if (req != NULL) {
+        req->IOSer.io_Actual = (u->ft_BufferSize + u->ft_Head - u->ft_Tail) % u->ft_BufferSize;
+        req->IOSer.io_Error = error;
+        ReplyMsg(&req->IOSer.io_Message);
+    }
+}
+
 // Return the number of byte available to read in the RX buffer
 // of a unit.
 inline unsigned long ft_Available(struct FTUnit *u) {
@@ -595,6 +1161,18 @@ inline unsigned long ft_Available(struct FTUnit *u) {
     return available - reserved;
 }
 
+// See if there's a terminator anywhere in the RX buffer of a unit.
+// Call with Forbid() held so the buffer doesn't change underneath.
+int ft_HasTerminator(struct FTUnit *u) {
+    unsigned long i;
+
+    if ((u->ft_Flags & SERF_EOFMODE) == 0) return 0;
+    for (i = u->ft_Tail; i != u->ft_Head; i = (i + 1) % u->ft_BufferSize) {
+        if (isTerminator(u, u->ft_Buffer[i]) == 1) return 1;
+    }
+    return 0;
+}
+
 // Read the next byte from the RX buffer of a unit, or return -1 if
 // no data is available to read.
 int ft_Read(struct FTUnit *u) {
@@ -619,21 +1197,449 @@ int ft_SetDefaultOptions(struct FTUnit *u) {
         return SerErr_BufErr;
     }
     u->ft_BufferSize = FT_BUFSIZ;
+    u->ft_Borrowed = 0;
+
+    ft_SetDefaultFlags(u);
+    return 0;
+}
 
+void ft_SetDefaultFlags(struct FTUnit *u) {
     u->ft_Flags = 0x84;
     u->ft_Terminator1 = 0x00;
     u->ft_Terminator2 = 0x00;
-    return 0;
+}
+
+// Microseconds since a given EClock reading. Good for a little over an
+// hour, which is plenty for a reply.
+static unsigned long usSince(struct EClockVal *then) {
+    struct EClockVal now;
+    ReadEClock(&now);
+    unsigned long diff = now.ev_lo - then->ev_lo;
+    if (diff > 4000000UL) {
+        return diff / eclockKHz * 1000;
+    }
+    return diff * 1000 / eclockKHz;
+}
+
+// Account for a read being replied, ready being when it last became
+// possible to complete it. Misses of the latency target shrink the
+// amount of work per pass so that replies get their turn sooner;
+// replies with plenty of time to spare let it grow back.
+static void latencyCheck(struct FTUnit *u, struct EClockVal *ready) {
+    if (TimerBase == NULL) {
+        return;
+    }
+
+    unsigned long us = usSince(ready);
+    u->ft_Replies++;
+    if (us > u->ft_Worst) {
+        u->ft_Worst = us;
+    }
+
+    if (u->ft_Latency == 0) {
+        return;
+    }
+
+    unsigned long max = u->ft_Quantum ? u->ft_Quantum : ~0UL;
+
+    // A pass can never store more than the buffer holds, so any quantum
+    // from there up is the same as no limit at all. Cutting back starts
+    // from there rather than from some huge number that would take many
+    // misses to make any difference.
+    if (us > u->ft_Latency) {
+        unsigned long min = FT_QUANTUM_MIN;
+        if (max < min) min = max;
+
+        u->ft_Missed++;
+        if (u->ft_QuantumNow > u->ft_BufferSize) u->ft_QuantumNow = u->ft_BufferSize;
+        u->ft_QuantumNow /= 2;
+        if (u->ft_QuantumNow < min) u->ft_QuantumNow = min;
+    } else if (us < u->ft_Latency / 2) {
+        if (u->ft_QuantumNow < u->ft_BufferSize && u->ft_QuantumNow < max - u->ft_QuantumNow / 4 - 1) {
+            u->ft_QuantumNow += u->ft_QuantumNow / 4 + 1;
+        } else {
+            u->ft_QuantumNow = max;
+        }
+    }
+}
+
+// Number of ticks that have passed since a given DateStamp.
+static unsigned long ticksSince(struct DateStamp *then) {
+    struct DateStamp now;
+    DateStamp(&now);
+    return ((now.ds_Days - then->ds_Days) * 24 * 60 + (now.ds_Minute - then->ds_Minute)) * 60 * TICKS_PER_SECOND
+        + (now.ds_Tick - then->ds_Tick);
 }
 
 // Pump a single byte out to the hardware for a unit.
 void writeChar(struct FTUnit *u, char c) {
+    if (u->ft_Loop != NULL) {
+        // Like the real thing we don't wait for space. If the queue
+        // is full the byte is lost, but at least we count it.
+        unsigned short next = (u->ft_LoopHead + 1) & (FT_LOOP_SIZE - 1);
+        if (next == u->ft_LoopTail) {
+            u->ft_LoopDropped++;
+            return;
+        }
+        u->ft_Loop[u->ft_LoopHead] = c;
+        u->ft_LoopHead = next;
+        return;
+    }
+
     // Wait for space in the fifo
     //while ((*u->ft_Status & FT_TXE) != 0);
     // Send the character
     *u->ft_Fifo = c;
 }
 
+// Read the status register of a unit. For the loopback unit the RXF
+// and TXE bits are made up from the state of the queue.
+static inline unsigned char ft_StatusReg(struct FTUnit *u) {
+    if (u->ft_Loop != NULL) {
+        unsigned char st = 0;
+        if (u->ft_LoopHead == u->ft_LoopTail) st |= FT_RXF;
+        if (((u->ft_LoopHead + 1) & (FT_LOOP_SIZE - 1)) == u->ft_LoopTail) st |= FT_TXE;
+        return st;
+    }
+    return *u->ft_Status;
+}
+
+// Take the next byte from the FIFO of a unit. Only valid when the
+// status register says there is one.
+static inline unsigned char ft_FifoRead(struct FTUnit *u) {
+    if (u->ft_Loop != NULL) {
+        unsigned char c = u->ft_Loop[u->ft_LoopTail];
+        u->ft_LoopTail = (u->ft_LoopTail + 1) & (FT_LOOP_SIZE - 1);
+        return c;
+    }
+    return *u->ft_Fifo;
+}
+
+
+// CRC-16/XMODEM, one table lookup per byte.
+static const unsigned short crcTable[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+#define CRC16(crc, c) ((unsigned short)(((crc) << 8) ^ crcTable[(((crc) >> 8) ^ (c)) & 0xFF]))
+
+// Map a sequence number from the wire onto its offset from the start
+// of the transfer window. Anything at or beyond FT_BLK_WINDOW lies
+// outside it, and 256 - FT_BLK_WINDOW and up are recent old blocks.
+static inline unsigned char blkOffset(struct FTUnit *u, unsigned char seq) {
+    return (unsigned char)(seq - (unsigned char)u->ft_BlkBase);
+}
+
+// Send one framed block of the active write. The CRC is worked out
+// as each byte goes out to the FIFO so the data is only walked once.
+static void blkSend(struct FTUnit *u, unsigned long idx) {
+    struct IOExtSer *req = u->ft_Block;
+    unsigned char *data = (unsigned char *)req->IOSer.io_Data + idx * FT_BLK_SIZE;
+    unsigned long len = 0;
+    unsigned short crc = 0;
+    unsigned long i;
+
+    if (idx < u->ft_BlkLast) {
+        len = req->IOSer.io_Length - idx * FT_BLK_SIZE;
+        if (len > FT_BLK_SIZE) len = FT_BLK_SIZE;
+    }
+
+    writeChar(u, FT_BLK_SOH);
+    writeChar(u, (unsigned char)idx);
+    crc = CRC16(crc, (unsigned char)idx);
+    writeChar(u, (unsigned char)len);
+    crc = CRC16(crc, (unsigned char)len);
+    for (i = 0; i < len; i++) {
+        writeChar(u, data[i]);
+        crc = CRC16(crc, data[i]);
+    }
+    writeChar(u, crc >> 8);
+    writeChar(u, crc & 0xFF);
+}
+
+// Reply to the active block transfer and drop it.
+static void blkFinish(struct FTUnit *u, int error) {
+    u->ft_Block->IOSer.io_Error = error;
+    ReplyMsg(&u->ft_Block->IOSer.io_Message);
+    u->ft_Block = NULL;
+}
+
+// Slide the window past every block at its start that is complete.
+static void blkSlide(struct FTUnit *u) {
+    while (u->ft_BlkDone & 1) {
+        u->ft_BlkDone >>= 1;
+        u->ft_BlkBase++;
+    }
+}
+
+// Set up the unit for a freshly arrived block transfer request.
+void ft_BlkStart(struct FTUnit *u) {
+    struct IOExtSer *req = u->ft_Block;
+
+    req->IOSer.io_Actual = 0;
+    u->ft_BlkBase = 0;
+    u->ft_BlkNext = 0;
+    u->ft_BlkDone = 0;
+    DateStamp(&u->ft_BlkHeard);
+    u->ft_BlkRetries = 0;
+    u->ft_BlkState = BLK_HUNT;
+
+    if (req->IOSer.io_Command == FTCMD_BLKWRITE) {
+        // The end of transfer block comes straight after the last data block.
+        u->ft_BlkLast = (req->IOSer.io_Length + FT_BLK_SIZE - 1) / FT_BLK_SIZE;
+    } else {
+        // Not known until the sender tells us.
+        u->ft_BlkLast = ~0UL;
+    }
+}
+
+// Feed one incoming byte to the acknowledgement parser of a write.
+static void blkWriteRx(struct FTUnit *u, unsigned char c) {
+    unsigned char off;
+
+    switch (u->ft_BlkState) {
+        case BLK_HUNT:
+            if (c == FT_BLK_ACK) u->ft_BlkState = BLK_ACK;
+            if (c == FT_BLK_NAK) u->ft_BlkState = BLK_NAK;
+            return;
+
+        case BLK_ACK:
+            u->ft_BlkState = BLK_HUNT;
+            off = blkOffset(u, c);
+            if (off < FT_BLK_WINDOW && u->ft_BlkBase + off < u->ft_BlkNext) {
+                u->ft_BlkDone |= 1 << off;
+                DateStamp(&u->ft_BlkHeard);
+                u->ft_BlkRetries = 0;
+                blkSlide(u);
+            }
+            return;
+
+        case BLK_NAK:
+            // Only the damaged block goes again, the rest of the window
+            // stays where it is.
+            u->ft_BlkState = BLK_HUNT;
+            off = blkOffset(u, c);
+            if (off < FT_BLK_WINDOW && u->ft_BlkBase + off < u->ft_BlkNext && (u->ft_BlkDone & (1 << off)) == 0) {
+                blkSend(u, u->ft_BlkBase + off);
+            }
+            return;
+    }
+}
+
+// Feed one incoming byte to the block parser of a read. The payload
+// is copied straight to its place in the reader's buffer, working out
+// the CRC on the way, so out of order blocks need no extra storage.
+static void blkReadRx(struct FTUnit *u, unsigned char c) {
+    struct IOExtSer *req = u->ft_Block;
+    unsigned char off;
+    unsigned long idx;
+
+    switch (u->ft_BlkState) {
+        case BLK_HUNT:
+            if (c == FT_BLK_SOH) {
+                u->ft_BlkCrc = 0;
+                u->ft_BlkState = BLK_SEQ;
+            }
+            return;
+
+        case BLK_SEQ:
+            u->ft_BlkSeq = c;
+            u->ft_BlkCrc = CRC16(u->ft_BlkCrc, c);
+            u->ft_BlkState = BLK_LEN;
+            return;
+
+        case BLK_LEN:
+            if (c > FT_BLK_SIZE) {
+                u->ft_BlkState = BLK_HUNT;
+                return;
+            }
+            u->ft_BlkLen = c;
+            u->ft_BlkPos = 0;
+            u->ft_BlkCrc = CRC16(u->ft_BlkCrc, c);
+            u->ft_BlkDst = NULL;
+
+            // Blocks we already hold, or that don't fit, are checked but
+            // not stored.
+            off = blkOffset(u, u->ft_BlkSeq);
+            if (off < FT_BLK_WINDOW && (u->ft_BlkDone & (1 << off)) == 0) {
+                idx = u->ft_BlkBase + off;
+                if (idx * FT_BLK_SIZE + c <= req->IOSer.io_Length) {
+                    u->ft_BlkDst = (unsigned char *)req->IOSer.io_Data + idx * FT_BLK_SIZE;
+                }
+            }
+            u->ft_BlkState = c ? BLK_DATA : BLK_CRCH;
+            return;
+
+        case BLK_DATA:
+            if (u->ft_BlkDst != NULL) {
+                u->ft_BlkDst[u->ft_BlkPos] = c;
+            }
+            u->ft_BlkCrc = CRC16(u->ft_BlkCrc, c);
+            if (++u->ft_BlkPos == u->ft_BlkLen) {
+                u->ft_BlkState = BLK_CRCH;
+            }
+            return;
+
+        case BLK_CRCH:
+            u->ft_BlkRxCrc = c << 8;
+            u->ft_BlkState = BLK_CRCL;
+            return;
+
+        case BLK_CRCL:
+            u->ft_BlkState = BLK_HUNT;
+            u->ft_BlkRxCrc |= c;
+            off = blkOffset(u, u->ft_BlkSeq);
+
+            if (u->ft_BlkRxCrc != u->ft_BlkCrc) {
+                DBG("BLK %lu bad CRC\r\n", (unsigned long)u->ft_BlkSeq);
+                if (off < FT_BLK_WINDOW && (u->ft_BlkDone & (1 << off)) == 0) {
+                    writeChar(u, FT_BLK_NAK);
+                    writeChar(u, u->ft_BlkSeq);
+                }
+                return;
+            }
+
+            if (off < FT_BLK_WINDOW) {
+                if (u->ft_BlkBase + off > u->ft_BlkLast) {
+                    // Past the end of the transfer, so not one of ours.
+                    return;
+                }
+                if ((u->ft_BlkDone & (1 << off)) == 0) {
+                    idx = u->ft_BlkBase + off;
+                    if (u->ft_BlkLen != 0 && u->ft_BlkDst == NULL) {
+                        // More data than the reader has room for.
+                        writeChar(u, FT_BLK_NAK);
+                        writeChar(u, u->ft_BlkSeq);
+                        blkFinish(u, SerErr_BufOverflow);
+                        return;
+                    }
+                    if (u->ft_BlkLen == 0) {
+                        u->ft_BlkLast = idx;
+                    } else if (idx * FT_BLK_SIZE + u->ft_BlkLen > req->IOSer.io_Actual) {
+                        req->IOSer.io_Actual = idx * FT_BLK_SIZE + u->ft_BlkLen;
+                    }
+                    u->ft_BlkDone |= 1 << off;
+                    blkSlide(u);
+                }
+            } else if (off < 256 - FT_BLK_WINDOW) {
+                // Not one of ours at all.
+                return;
+            }
+
+            // Good blocks are always acknowledged, including repeats of
+            // ones we already have in case our earlier ACK got lost.
+            writeChar(u, FT_BLK_ACK);
+            writeChar(u, u->ft_BlkSeq);
+            DateStamp(&u->ft_BlkHeard);
+            u->ft_BlkRetries = 0;
+            return;
+    }
+}
+
+// Run one pass of the active block transfer: consume whatever has
+// arrived in the RX buffer, then push out new blocks and deal with
+// timeouts.
+void ft_BlkService(struct FTUnit *u) {
+    struct IOExtSer *req = u->ft_Block;
+    int writing = (req->IOSer.io_Command == FTCMD_BLKWRITE);
+    unsigned long head = u->ft_Head;
+    unsigned long tail = u->ft_Tail;
+    unsigned long i;
+
+    // Walk the buffer directly rather than through ft_Read(). Only
+    // this task ever moves the tail, so no Forbid() is needed per byte.
+    while (tail != head && u->ft_Block != NULL) {
+        unsigned char c = u->ft_Buffer[tail];
+        if (++tail == u->ft_BufferSize) tail = 0;
+        if (writing) {
+            blkWriteRx(u, c);
+        } else {
+            blkReadRx(u, c);
+        }
+    }
+    u->ft_Tail = tail;
+
+    if (u->ft_Block == NULL) {
+        return;
+    }
+
+    if (!writing && u->ft_BlkBase > u->ft_BlkLast) {
+        // Everything is in, but our ACK of the end of transfer block
+        // may have been lost. Keep answering repeats of it until the
+        // sender has been quiet for well over its resend interval, so
+        // that it doesn't give up on a transfer that worked and its
+        // retries don't get left behind for the next read.
+        if (ticksSince(&u->ft_BlkHeard) >= FT_BLK_QUIET) {
+            blkFinish(u, 0);
+        }
+        return;
+    }
+
+    if (writing) {
+        if (u->ft_BlkBase > u->ft_BlkLast) {
+            req->IOSer.io_Actual = req->IOSer.io_Length;
+            blkFinish(u, 0);
+            return;
+        }
+
+        // Keep the window full.
+        while (u->ft_BlkNext < u->ft_BlkBase + FT_BLK_WINDOW && u->ft_BlkNext <= u->ft_BlkLast) {
+            blkSend(u, u->ft_BlkNext++);
+            DateStamp(&u->ft_BlkHeard);
+        }
+    }
+
+    if (ticksSince(&u->ft_BlkHeard) < FT_BLK_TIMEOUT) {
+        return;
+    }
+    DateStamp(&u->ft_BlkHeard);
+
+    if (++u->ft_BlkRetries > FT_BLK_RETRIES) {
+        DBG("BLK timeout\r\n");
+        blkFinish(u, SerErr_TimerErr);
+        return;
+    }
+
+    // Nothing heard for a while: resend whatever is still outstanding.
+    if (writing) {
+        for (i = u->ft_BlkBase; i < u->ft_BlkNext; i++) {
+            if ((u->ft_BlkDone & (1 << (i - u->ft_BlkBase))) == 0) {
+                blkSend(u, i);
+            }
+        }
+    }
+}
 
 // This is the main processing routine. It is spawned once
 // per unit and sits looking for incoming data and processes
@@ -653,7 +1659,7 @@ void commsManager() { //
     struct Task *self = FindTask(NULL);
     struct FTUnit *thisUnit = self->tc_UserData;
 
-    if (thisUnit != &units[0]) {
+    if (thisUnit < &units[0] || thisUnit >= &units[NUM_UNITS]) {
         return;
     }
 
@@ -670,32 +1676,76 @@ void commsManager() { //
 
     //DBG("Ports made\r\n");
 
+    thisUnit->ft_QuantumNow = thisUnit->ft_Quantum ? thisUnit->ft_Quantum : ~0UL;
+    thisUnit->ft_Replies = thisUnit->ft_Missed = thisUnit->ft_Worst = 0;
 
     unsigned long iterations = 0;
+    unsigned long taken = 0;        // Bytes taken from the FIFO since we last gave up the CPU
+    struct DateStamp idleSince;     // When we noticed the unit had been closed
+    struct EClockVal ready;         // When the current reader could last have made progress
+    char idle = 0;
 
     while(!done) {
-
+        unsigned long head = thisUnit->ft_Head;
+        unsigned long quantum = thisUnit->ft_QuantumNow;
+        char starved = (TUR != NULL && head == thisUnit->ft_Tail);
 
         // The first thing to do is grab a byte from the FT245R's FIFO if there
         // is anything available, and of course only if there is room in the RX
         // buffer to store it.
-        while ((*thisUnit->ft_Status & FT_RXF) == 0) { // There is something to read
+        while ((ft_StatusReg(thisUnit) & FT_RXF) == 0) { // There is something to read
             unsigned long bufIndex = (thisUnit->ft_Head + 1) % thisUnit->ft_BufferSize;
             // If there's no room left in the buffer then stop reading
             if (bufIndex == thisUnit->ft_Tail) { 
                 break;
             }
 
+            // Don't hog the loop; leave the rest for the next pass.
+            if (quantum-- == 0) {
+                break;
+            }
+
+            // For a reader that had run dry, new data is the moment it
+            // could start making progress again.
+            if (starved && thisUnit->ft_Head == head && TimerBase != NULL) {
+                ReadEClock(&ready);
+            }
+
             // Grab the character from the fifo
-            char c = *thisUnit->ft_Fifo;
+            char c = ft_FifoRead(thisUnit);
             // Store it in the buffer
             thisUnit->ft_Buffer[thisUnit->ft_Head] = c;
             // Advance the head
             thisUnit->ft_Head = bufIndex;
+
+            // Anyone waiting for a terminator can be woken right away.
+            if (thisUnit->ft_Notify != NULL && isTerminator(thisUnit, c) == 1) {
+                ft_EndNotify(thisUnit, 0);
+            }
+        }
+
+        taken += (thisUnit->ft_BufferSize + thisUnit->ft_Head - head) % thisUnit->ft_BufferSize;
+
+        // Everything that came in this time round goes to the capture too.
+        if (thisUnit->ft_CapOn && thisUnit->ft_Head != head) {
+            capBurst(thisUnit, head);
         }
 
+        // Or once enough has piled up. The request might be aborted under
+        // our feet, so only the threshold saved with it is looked at and
+        // ft_EndNotify() checks again before replying.
+        if (thisUnit->ft_Notify != NULL && thisUnit->ft_Head != head) {
+            if ((thisUnit->ft_BufferSize + thisUnit->ft_Head - thisUnit->ft_Tail) % thisUnit->ft_BufferSize >= thisUnit->ft_NotifyLength) {
+                ft_EndNotify(thisUnit, 0);
+            }
+        }
+
+        // A block transfer takes over the incoming data until it completes.
+        if (thisUnit->ft_Block != NULL) {
+            ft_BlkService(thisUnit);
+
         // Now we'll get some data for the active read message if there is one.
-        if (TUR != NULL) {
+        } else if (TUR != NULL) {
             unsigned long cando = (thisUnit->ft_BufferSize + thisUnit->ft_Head - thisUnit->ft_Tail) % thisUnit->ft_BufferSize;
             // If we have at least one byte available
             if (cando > 0) {
@@ -727,6 +1777,7 @@ void commsManager() { //
                     if (isTerminator(thisUnit, c) == 1) {
                         DBG("!T!\r\n");
                         // Finish the read and reply
+                        latencyCheck(thisUnit, &ready);
                         ReplyMsg(&TUR->IOSer.io_Message);
                         TUR = NULL;
                         break;
@@ -739,6 +1790,7 @@ void commsManager() { //
                     if (TUR->IOSer.io_Actual >= TUR->IOSer.io_Length) {
                         DBG("FIN: %lu\r\n", TUR->IOSer.io_Actual);
                         // Finish the read and reply
+                        latencyCheck(thisUnit, &ready);
                         ReplyMsg(&TUR->IOSer.io_Message);
                         thisUnit->ft_Reader = NULL;
                     }
@@ -755,9 +1807,25 @@ void commsManager() { //
                 }
             }
         } else { // Look for a new message
-            TUR = (struct IOExtSer *)GetMsg(thisUnit->ft_ReadPort);
+            // Taking a new reader and checking for borrowed data has to be
+            // done in one go, or FTCMD_BORROW could slip in between.
+            Forbid();
+            if (thisUnit->ft_Borrowed == 0) {
+                TUR = (struct IOExtSer *)GetMsg(thisUnit->ft_ReadPort);
+                if (TUR != NULL && TUR->IOSer.io_Command != CMD_READ) {
+                    thisUnit->ft_Block = TUR;
+                    TUR = NULL;
+                }
+            }
+            Permit();
+            if (thisUnit->ft_Block != NULL) {
+                ft_BlkStart(thisUnit);
+            }
             if (TUR != NULL) {
-                // If we got a new message prep it 
+                // If we got a new message prep it. begin_io() left the
+                // time it was sent in io_Actual.
+                ready.ev_hi = 0;
+                ready.ev_lo = TUR->IOSer.io_Actual;
                 TUR->IOSer.io_Actual = 0;
                 iterations = 0;
                 DBG("New reader (%lu)\r\n", TUR->IOSer.io_Length);
@@ -811,6 +1879,21 @@ void commsManager() { //
                     ReplyMsg(&msg->IOSer.io_Message);
                     break;
 
+                case CMD_ABORT_BLOCK:
+                    if (thisUnit->ft_Block != NULL) { 
+                        thisUnit->ft_Block->IOSer.io_Error = IOERR_ABORTED;
+                        ReplyMsg(&thisUnit->ft_Block->IOSer.io_Message);
+                        thisUnit->ft_Block = NULL;
+                    }
+                    ReplyMsg(&msg->IOSer.io_Message);
+                    break;
+
+                case CMD_CAPTURE_OFF:
+                    // Stop feeding the capture ring so it can be freed.
+                    thisUnit->ft_CapOn = 0;
+                    ReplyMsg(&msg->IOSer.io_Message);
+                    break;
+
                 case CMD_KILLPROC:
                     // This will request the termination of this task. It basically
                     // means stop executing the loop and fall through to finish
@@ -825,6 +1908,62 @@ void commsManager() { //
         // If nothing was done during this pass we'll introduce a very small delay.
         // This might (though don't quote me as I don't understand the scheduler)
         // allow other tasks more processing and "lighten" this one while idling.
+
+        // While the unit is closed and lingering nobody is waiting on us, so
+        // we can afford to sleep a tick whenever there was nothing to store.
+        if (thisUnit->ft_Idle) {
+            if (!idle) {
+                DateStamp(&idleSince);
+                idle = 1;
+            }
+
+            if (ticksSince(&idleSince) >= thisUnit->ft_Linger) {
+                // Time's up. Stay forbidden from here on so that open()
+                // either sees us still idle and takes us back, or sees
+                // everything gone and starts afresh. The Forbid() ends
+                // when this task does.
+                Forbid();
+                if (thisUnit->ft_Idle) {
+                    done = 1;
+                    break;
+                }
+                Permit();
+            }
+
+            if (thisUnit->ft_Head == head) {
+                Delay(1);
+            }
+        } else {
+            idle = 0;
+
+            // Once a whole quantum has come in since we last let go of the
+            // CPU, give it up for a tick. That is what keeps a steady
+            // trickle of background traffic from taking the whole machine.
+            // With nothing in progress and a latency target of a tick or
+            // more we can also sleep through quiet spells instead of
+            // spinning, and still pick up new requests and data in time.
+            // Readers time out by counting passes, and a block transfer
+            // wants its acknowledgements seen promptly, so we don't sleep
+            // for that while one of those is active.
+            if (thisUnit->ft_Quantum != 0 && taken >= thisUnit->ft_Quantum) {
+                taken = 0;
+                Delay(1);
+            } else if (thisUnit->ft_Latency >= 1000000 / TICKS_PER_SECOND && thisUnit->ft_Head == head
+                && TUR == NULL && thisUnit->ft_Block == NULL) {
+                taken = 0;
+                Delay(1);
+            }
+        }
+    }
+
+    if (idle) {
+        // Nobody is going to close us, so the buffer is ours to free.
+        // ft_Task is cleared while we're still forbidden, so an expunge
+        // that was put off for us can only go ahead once we're gone.
+        FreeMem((char *)thisUnit->ft_Buffer, thisUnit->ft_BufferSize);
+        thisUnit->ft_Buffer = NULL;
+        thisUnit->ft_Idle = 0;
+        thisUnit->ft_Task = NULL;
     }
 
 
@@ -840,3 +1979,88 @@ void commsManager() { //
 }
 
 
+// The capture helper. It runs as its own process, one per capture,
+// and writes the capture ring out to the file in big pieces so that
+// the comms task never has to touch the disk.
+void captureManager() {
+    unsigned long quiet = 0;
+    struct Process *self = (struct Process *)FindTask(NULL);
+    struct IOExtSer *msg;
+
+    // The startup message comes to the process port. Nothing else uses
+    // it yet; once we're doing DOS I/O it belongs to DOS, so the stop
+    // message comes to a port of our own instead.
+    WaitPort(&self->pr_MsgPort);
+    msg = (struct IOExtSer *)GetMsg(&self->pr_MsgPort);
+    struct FTUnit *thisUnit = (struct FTUnit *)msg->IOSer.io_Unit;
+
+    thisUnit->ft_CapPort = CreateMsgPort();
+    thisUnit->ft_CapFile = thisUnit->ft_CapPort ? Open(msg->IOSer.io_Data, MODE_NEWFILE) : 0;
+    if (thisUnit->ft_CapFile == 0) {
+        if (thisUnit->ft_CapPort != NULL) {
+            DeleteMsgPort(thisUnit->ft_CapPort);
+            thisUnit->ft_CapPort = NULL;
+        }
+        // Reply forbidden so that we're gone before the caller cleans up.
+        Forbid();
+        thisUnit->ft_CapTask = NULL;
+        msg->IOSer.io_Error = IOERR_OPENFAIL;
+        ReplyMsg(&msg->IOSer.io_Message);
+        return;
+    }
+    ReplyMsg(&msg->IOSer.io_Message);
+    msg = NULL;
+
+    // A small ring must be written out well before it fills.
+    unsigned long chunk = FT_CAPCHUNK;
+    if (chunk > thisUnit->ft_CapSize / 2) chunk = thisUnit->ft_CapSize / 2;
+    unsigned long seen = thisUnit->ft_CapHead;
+
+    for (;;) {
+        if (msg == NULL) {
+            msg = (struct IOExtSer *)GetMsg(thisUnit->ft_CapPort);
+        }
+        char stop = (msg != NULL);
+        unsigned long head = thisUnit->ft_CapHead;
+        unsigned long tail = thisUnit->ft_CapTail;
+        unsigned long pending = (thisUnit->ft_CapSize + head - tail) % thisUnit->ft_CapSize;
+
+        // Only count looks where nothing new has come in.
+        if (head != seen) {
+            seen = head;
+            quiet = 0;
+        }
+
+        if (pending >= chunk || (pending > 0 && (stop || quiet >= FT_CAPQUIET))) {
+            // Write as much as is in one piece. If it wraps round the
+            // rest goes on the next pass.
+            unsigned long len = head > tail ? head - tail : thisUnit->ft_CapSize - tail;
+            if (Write(thisUnit->ft_CapFile, thisUnit->ft_Cap + tail, len) == len) {
+                thisUnit->ft_CapWritten += len;
+            } else {
+                thisUnit->ft_CapDropped += len;
+            }
+            thisUnit->ft_CapTail = (tail + len) % thisUnit->ft_CapSize;
+            quiet = 0;
+            continue;
+        }
+
+        if (stop) {
+            break;
+        }
+
+        Delay(FT_CAPPOLL);
+        quiet++;
+    }
+
+    Close(thisUnit->ft_CapFile);
+    thisUnit->ft_CapFile = 0;
+    DeleteMsgPort(thisUnit->ft_CapPort);
+    thisUnit->ft_CapPort = NULL;
+
+    // Reply forbidden and stay that way until we're gone, so that
+    // ft_StopCapture() doesn't free anything while we're still around.
+    Forbid();
+    thisUnit->ft_CapTask = NULL;
+    ReplyMsg(&msg->IOSer.io_Message);
+}
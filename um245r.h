@@ -0,0 +1,128 @@
+#ifndef _UM245R_H
+#define _UM245R_H
+
+#include <exec/io.h>
+#include <dos/dos.h>
+
+// Unit 0 is the FT245R itself. Unit 1 has no hardware behind it:
+// everything written to it comes straight back to be read, which is
+// handy for measuring the cost of the driver on its own. Its queue
+// holds FT_LOOP_SIZE - 1 bytes; anything written past that is lost,
+// and SDCMD_QUERY sets IO_STATF_OVERRUN if any was since the last one.
+#define FT_UNIT_LOOPBACK 1
+#define FT_LOOP_SIZE 4096
+
+// Non-standard commands understood by um245r.device on top of the
+// usual serial.device set.
+
+// Reliable block transfers. io_Data / io_Length describe the buffer to
+// send or fill. A read completes once the sender's end-of-transfer
+// block has arrived and the line has then been quiet for two seconds,
+// in case the sender didn't hear our acknowledgement and sends it again.
+// io_Actual holds the number of bytes received.
+#define FTCMD_BLKREAD (CMD_NONSTD + 10)
+#define FTCMD_BLKWRITE (CMD_NONSTD + 11)
+
+// Keep the comms task and its receive buffer alive for io_Length ticks
+// after the unit is closed. Data keeps arriving into the buffer in the
+// meantime and reopening within that time is immediate. Zero turns
+// this off again. Expunging the device cuts a linger short.
+#define FTCMD_SETLINGER (CMD_NONSTD + 12)
+
+// Look at the data waiting in the receive buffer without copying it.
+// io_Data points to a struct FTSpans which is filled in with up to two
+// pieces of the ring buffer, in order; io_Actual is their total size.
+// The bytes stay where they are, and reads wait, until they are given
+// back with FTCMD_RELEASE, where io_Length is how many bytes from the
+// start of the first span are done with. Borrowing again returns the
+// rest plus anything new. Fails with SerErr_DevBusy while a read is
+// in progress.
+#define FTCMD_BORROW (CMD_NONSTD + 13)
+#define FTCMD_RELEASE (CMD_NONSTD + 14)
+
+struct FTSpans {
+    UBYTE *fs_Data[2];
+    ULONG fs_Length[2];
+};
+
+// Wait for data without committing a read buffer. The request is held
+// until the receive buffer holds at least io_Length bytes or, in
+// SERF_EOFMODE, a terminator arrives; io_Actual is then the number of
+// bytes waiting. It comes back at once if there is already enough, or
+// a terminator is already waiting in the buffer.
+// io_Length must be below the buffer size, or the request fails with
+// SerErr_InvParam. Only one may be outstanding per unit; use AbortIO()
+// to cancel it.
+// Sent with SendIO() it wakes the caller through the reply port, so a
+// PA_SIGNAL port gives a plain signal bit to Wait() on.
+#define FTCMD_NOTIFY (CMD_NONSTD + 15)
+
+// Mirror everything received into a file. io_Data points to a struct
+// FTCapture. With fc_File set a capture into that file is started;
+// with fc_File NULL the running one is stopped and fc_Written and
+// fc_Dropped say how it went. Data is staged in a ring of fc_Size
+// bytes (0 for a default, otherwise at least 256) and written out by a
+// helper process; when the disk can't keep up whole bursts are dropped
+// and counted rather than slowing down readers. Closing the unit also
+// stops a capture.
+#define FTCMD_CAPTURE (CMD_NONSTD + 16)
+
+// With FTCAPF_TIMESTAMP each burst in the file is preceded by a
+// struct FTCaptureHeader saying when it arrived and how long it is.
+#define FTCAPF_TIMESTAMP 0x01
+
+struct FTCapture {
+    STRPTR fc_File;
+    ULONG fc_Size;
+    ULONG fc_Flags;
+    ULONG fc_Written;
+    ULONG fc_Dropped;
+};
+
+struct FTCaptureHeader {
+    struct DateStamp ch_Time;
+    ULONG ch_Length;
+};
+
+// Tune the comms task of a unit. io_Data points to a struct FTTuning.
+// FTCMD_SETTUNING applies tn_Priority, tn_Quantum and tn_Latency at
+// once and clears the statistics; FTCMD_GETTUNING fills in everything.
+//
+// tn_Quantum caps how many bytes the comms task takes from the FIFO
+// before it gives up the CPU for a tick (0 for no cap). With a
+// tn_Latency target, in microseconds, the driver measures how long
+// each read takes to be replied, from when it was sent or, if it had
+// to wait for data, from when that arrived. When a reply misses the
+// target it takes smaller pieces from the FIFO per pass of its loop
+// (tn_QuantumNow) so that replies get their turn sooner. When the
+// target is a tick or more, it also sleeps through idle spells instead
+// of polling. tn_Missed counts the replies that came too late.
+#define FTCMD_SETTUNING (CMD_NONSTD + 17)
+#define FTCMD_GETTUNING (CMD_NONSTD + 18)
+
+struct FTTuning {
+    LONG tn_Priority;
+    ULONG tn_Quantum;
+    ULONG tn_Latency;
+    ULONG tn_QuantumNow;
+    ULONG tn_Replies;
+    ULONG tn_Missed;
+    ULONG tn_Worst;
+};
+
+// Block framing on the wire. Each block is sent as
+//
+//   SOH seq len data[len] crc-hi crc-lo
+//
+// where seq is the block number modulo 256 and the CRC is CRC-16/XMODEM
+// over seq, len and the data. A block with len 0 marks the end of the
+// transfer. The receiver answers every good block with ACK seq and
+// every damaged one with NAK seq. Up to FT_BLK_WINDOW blocks may be
+// unacknowledged at once.
+#define FT_BLK_SOH 0x01
+#define FT_BLK_ACK 0x06
+#define FT_BLK_NAK 0x15
+#define FT_BLK_SIZE 128
+#define FT_BLK_WINDOW 8
+
+#endif